@@ -0,0 +1,114 @@
+// Fn body code generation benchmark
+//
+// usage: bin/bench_fn_codegen [nfns] [reps]
+//
+// Parses a generated file of nfns functions (default 5000) with lazy bodies,
+// then compiles every body with CodeGen::compileFns() serially and at
+// increasing thread counts, checking that every result is identical to the
+// serial bytecode and gives the top-level vars the same slots.
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "codegen.hpp"
+#include "expr.hpp"
+#include "parse.hpp"
+#include "pool.hpp"
+#include "scan.hpp"
+#include "time.hpp"
+
+// each fn calls the one before it; every third defines a helper of its own.
+// Each reads the top-level var scale, and late<n>, which only its body
+// refers to, so compileFns() is the one to give it a slot
+std::string genSource(int nfns) {
+    std::string src = "var scale = 1.5;\n";
+    for (int i = 0; i < nfns; i++) {
+        std::string n = std::to_string(i);
+        src += "fn f" + n + "(a, b, c) {\n";
+        src += "    var x = a * scale + b / 3 - (c + " + n + ") + late" + n + ";\n";
+        src += "    var y = (x - 1e3) * (x + 0x1F) / -(a - b) or c and !True;\n";
+        if (i % 3 == 0)
+            src += "    fn g" + n + "(p) { ret p * p + " + n + "; };\n";
+        src += "    print \"f" + n + "\" cmp \"x\";\n";
+        if (i)
+            src += "    var z = f" + std::to_string(i - 1) + "(x, y, 2.5) + a;\n";
+        src += "    ret x + y * (b - c) / 4;\n";
+        src += "};\n";
+    }
+    return src;
+}
+
+// the program's chunk, with every body still recorded as a source range;
+// its top-level vars are in globals, as with CodeGen::genCode()
+Chunk defineFns(const std::string& src, FnTable& fns, GlobalTable& globals) {
+    TokenBuffer tokens = Scanner(src.c_str(), src.size()).scan();
+    Arena arena;
+    Parser parser(tokens, arena);
+    Chunk code;
+    code.fns = &fns;
+    code.globals = &globals;
+    for (auto stmt : parser.ParseStatements()) {
+        stmt->codegen(code);
+        code.addOp(OP_POP);
+    }
+    return code;
+}
+
+bool sameSlots(GlobalTable& a, GlobalTable& b) {
+    if (a.size() != b.size())
+        return false;
+    for (size_t slot = 0; slot < a.size(); slot++)
+        if (a.name(slot) != b.name(slot))
+            return false;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int nfns = argc > 1 ? atoi(argv[1]) : 5000;
+    int reps = argc > 2 ? atoi(argv[2]) : 3;
+    std::string src = genSource(nfns);
+
+    FnTable fns;
+    GlobalTable expected_globals;
+    Chunk expected = defineFns(src, fns, expected_globals);
+    size_t nbodies = CodeGen::compileFns(expected, 1);
+
+    double serial_ms = 0;
+    for (int r = 0; r < reps; r++) {
+        GlobalTable globals;
+        Chunk code = defineFns(src, fns, globals);
+        auto starttime = getTime();
+        CodeGen::compileFns(code, 1);
+        serial_ms += timeSinceMilli(starttime) / reps;
+    }
+
+    printf("input: %zu bytes, %d fns, %zu bodies, %d hardware threads\n",
+           src.size(),
+           nfns,
+           nbodies,
+           defaultJobs());
+    printf("serial     : %8.3f ms\n", serial_ms);
+
+    bool ok = true;
+    for (int jobs = 2; jobs <= std::max(8, defaultJobs()); jobs *= 2) {
+        double ms = 0;
+        bool same = true;
+        for (int r = 0; r < reps; r++) {
+            GlobalTable globals;
+            Chunk code = defineFns(src, fns, globals);
+            auto starttime = getTime();
+            CodeGen::compileFns(code, jobs);
+            ms += timeSinceMilli(starttime) / reps;
+            same &= code == expected and sameSlots(globals, expected_globals);
+        }
+
+        ok &= same;
+        printf("jobs = %-3d : %8.3f ms  speedup %.2fx  %s\n",
+               jobs,
+               ms,
+               serial_ms / ms,
+               same ? "identical" : "MISMATCH");
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,95 @@
+// Constant folding benchmark
+//
+// usage: bin/bench_fold [nlines] [reps]
+//
+// Times Folder::foldProgram() on a generated program of nlines statements
+// (default 20000): vars defined to literals, some of them assigned again
+// later, and arithmetic over them. First checks that var propagation stops at
+// a var defined or assigned more than once, at top level or in a fn body,
+// parsed or left lazy.
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "fold.hpp"
+#include "parse.hpp"
+#include "scan.hpp"
+#include "time.hpp"
+
+// a source, and what its last statement must fold to
+struct Case {
+    const char* src;
+    const char* expected;
+};
+const Case cases[] = {
+    {"var a = 1; print a;", "print 1;"},
+    {"var a = 1; a = 2; print a;", "print a;"},
+    {"var a = 1; if True { a = 2; } print a;", "print a;"},
+    {"var a = 1; var a = 2; print a;", "print a;"},
+    {"var a = 1; fn f() { a = 2; }; print a;", "print a;"},
+    {"var a = 1; fn f() { fn g() { a = 2; }; }; print a;", "print a;"},
+    {"var a = 1; fn f() { var a = 2; ret a; }; print a;", "print 1;"},
+    {"var a = 1; fn f(b) { ret b * a; }; print a;", "print 1;"},
+};
+
+// last statement of src, folded or not
+std::string lastStatement(const std::string& src, bool fold, bool lazy) {
+    TokenBuffer tokens = Scanner(src.c_str(), src.size()).scan();
+    Arena arena;
+    Parser parser(tokens, arena);
+    parser.lazy_bodies = lazy;
+    auto statements = parser.ParseStatements();
+    if (fold)
+        Folder(arena).foldProgram(statements);
+    return statements.empty() ? "" : statements.back()->str();
+}
+
+std::string genSource(int nlines) {
+    std::string src;
+    for (int i = 0; i < nlines; i++) {
+        std::string v = "v" + std::to_string(i / 4 * 4);
+        switch (i % 4) {
+        case 0: src += "var " + v + " = " + std::to_string(i) + ";\n"; break;
+        case 1: src += "print " + v + " * 2 + 1;\n"; break;
+        case 2: src += i % 8 == 2 ? v + " = 7;\n" : "var w" + std::to_string(i) + " = -(" + v + " - 1);\n"; break;
+        default: src += "fn f" + std::to_string(i) + "(x) { ret x / " + v + "; };\n"; break;
+        }
+    }
+    return src;
+}
+
+int main(int argc, char** argv) {
+    int nlines = argc > 1 ? atoi(argv[1]) : 20000;
+    int reps = argc > 2 ? atoi(argv[2]) : 10;
+
+    int failed = 0;
+    for (const Case& c : cases) {
+        for (bool lazy : {true, false}) {
+            std::string got = lastStatement(c.src, true, lazy);
+            if (got != lastStatement(c.expected, false, lazy)) {
+                fprintf(stderr, "%s (%s bodies) folds to %s\n", c.src, lazy ? "lazy" : "parsed", got.c_str());
+                failed++;
+            }
+        }
+    }
+    printf("%zu propagation cases: %s\n", std::size(cases), failed ? "FAILED" : "ok");
+
+    std::string src = genSource(nlines);
+    TokenBuffer tokens = Scanner(src.c_str(), src.size()).scan();
+    double ms = 0;
+    size_t nfolded = 0;
+    for (int rep = 0; rep < reps; rep++) {
+        Arena arena;
+        Parser parser(tokens, arena);
+        auto statements = parser.ParseStatements();
+        Folder folder(arena);
+        auto starttime = getTime();
+        folder.foldProgram(statements);
+        ms += timeSinceMilli(starttime);
+        nfolded = folder.nfolded;
+    }
+    printf("input: %d lines, %zu bytes\n", nlines, src.size());
+    printf("foldProgram : %8.3f ms  %zu nodes folded\n", ms / reps, nfolded);
+    return failed ? 1 : 0;
+}
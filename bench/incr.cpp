@@ -0,0 +1,179 @@
+// Incremental reparse benchmark
+//
+// usage: bin/bench_incr [nedits] [seed]
+//
+// Applies nedits random edits (default 2000) to a generated Document: numbers
+// and names respelled, statements inserted, copied, removed, commented out or
+// turned into string literals, and newlines, comments and quotes added
+// between tokens and inside strings. Every edit keeps the program well-formed. After
+// each one the tokens, statement starts and statements are checked against a
+// fresh Document built from the edited text, and the time of applyEdit() is
+// compared with that rebuild.
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "incr.hpp"
+#include "time.hpp"
+
+// fns, vars, prints, comments and strings that span lines
+std::string genSource(int nstmts) {
+    static const char* stmts[] = {"var v = 1 + 2.5 * x;\n",
+                                  "print \"one\nline # two\";\n",
+                                  "# a comment with a \"quote\n",
+                                  "fn f(a, b) {\n    var s = a * 0x1F;\n    # ret a;\n    ret s + b;\n};\n",
+                                  "(a + b) / 4 - -(1e3 cmp b);\n",
+                                  "fn g(s, c) {\n    if s - c {\n        ret c;\n    }\n    else {\n"
+                                  "        ret \"s\n\";\n    }\n};\n",
+                                  "print f(1, \"#\") or !True;\n"};
+    constexpr int nkinds = sizeof(stmts) / sizeof(stmts[0]);
+    std::string src;
+    for (int i = 0; i < nstmts; i++)
+        src += stmts[(i * 5 + i / 3) % nkinds];
+    return src;
+}
+
+struct Editor {
+    Editor(unsigned seed, size_t min_size) : rng(seed), min_size(min_size) {}
+
+    // one random well-formed edit of doc, as offset, removed, inserted
+    bool pick(const Document& doc, size_t& offset, size_t& removed, std::string& inserted) {
+        static const char* nums[] = {"7", "42", "2.5", "1e3", "0x1F", "1.5E-3"};
+        static const char* names[] = {"a", "b", "x1", "a_longer_name", "q"};
+        static const char* stmts[] = {"var q = 1 + 2;\n",
+                                      "# \"quoted\" and { unbalanced\n",
+                                      "print \"multi\nline # not a comment\";\n",
+                                      "fn h(p) { ret p * 2; };\n",
+                                      "\n\n"};
+        static const char* fillers[] = {" ", "\n", "\n# note \"q\n", "  # } { ;\n"};
+        static const char* in_strings[] = {"#", "\n", "x y", "# not a comment\n"};
+        const TokenBuffer& tokens = doc.tokens;
+        if (tokens.size() == 0 or doc.stmt_starts.empty()) {
+            offset = removed = 0;
+            inserted = "var q = 1;\n";
+            return true;
+        }
+        size_t i = rand(tokens.size());
+        size_t k = rand(doc.stmt_starts.size());
+        size_t stmt_begin = doc.lexemeStart(doc.stmt_starts[k]);
+        size_t last_tok = k + 1 < doc.stmt_starts.size() ? doc.stmt_starts[k + 1] - 1 : tokens.size() - 1;
+        size_t stmt_end = k + 1 < doc.stmt_starts.size() ? doc.lexemeStart(doc.stmt_starts[k + 1]) : doc.text.size();
+        std::string_view stmt(doc.text.data() + stmt_begin, stmt_end - stmt_begin);
+
+        removed = 0;
+        inserted.clear();
+        switch (rand(8)) {
+        case 0: // respell a number
+            if (tokens.type(i) != NUM)
+                return false;
+            offset = tokens.offsets[i], removed = tokens.lengths[i];
+            inserted = nums[rand(std::size(nums))];
+            return true;
+        case 1: // rename an identifier
+            if (tokens.type(i) != ID)
+                return false;
+            offset = tokens.offsets[i], removed = tokens.lengths[i];
+            inserted = names[rand(std::size(names))];
+            return true;
+        case 2: // insert a statement, or another copy of one
+            offset = stmt_begin;
+            inserted = rand(2) ? stmts[rand(std::size(stmts))] : std::string(stmt);
+            return true;
+        case 3: // remove a statement, keeping the text around its size
+            if (doc.text.size() < min_size)
+                return false;
+            offset = stmt_begin, removed = stmt.size();
+            return true;
+        case 4: // newlines and comments between tokens
+            offset = doc.lexemeEnd(i);
+            inserted = fillers[rand(std::size(fillers))];
+            return true;
+        case 5: // inside a string literal
+            if (tokens.type(i) != STRING)
+                return false;
+            offset = tokens.offsets[i] + rand(tokens.lengths[i] + 1);
+            inserted = in_strings[rand(std::size(in_strings))];
+            return true;
+        case 6: // statement into a string literal
+            if (stmt.find('"') != stmt.npos)
+                return false;
+            offset = stmt_begin, removed = stmt.size();
+            inserted = "print \"" + std::string(stmt) + "\";\n";
+            return true;
+        default: { // comment out a statement alone on its line
+            size_t nl = doc.text.find('\n', stmt_begin);
+            if (nl < doc.lexemeEnd(last_tok) or (nl >= stmt_end and stmt_end != doc.text.size()))
+                return false;
+            offset = stmt_begin;
+            inserted = "# ";
+            return true;
+        }
+        }
+    }
+
+    size_t rand(size_t n) { return std::uniform_int_distribution<size_t>(0, n - 1)(rng); }
+    std::mt19937 rng;
+    size_t min_size;
+};
+
+// what differs between doc and expected, or nullptr
+const char* difference(const Document& doc, const Document& expected) {
+    const TokenBuffer &a = doc.tokens, &b = expected.tokens;
+    if (a.size() != b.size())
+        return "token count";
+    for (size_t i = 0; i < a.size(); i++) {
+        Token x = a[i], y = b[i];
+        if (x.type != y.type or x.str != y.str or x.offset != y.offset or x.num != y.num)
+            return "tokens";
+    }
+    if (doc.stmt_starts != expected.stmt_starts)
+        return "statement starts";
+    for (size_t k = 0; k < doc.statements.size(); k++)
+        if (doc.statements[k]->str() != expected.statements[k]->str())
+            return "statements";
+    return nullptr;
+}
+
+int main(int argc, char** argv) {
+    int nedits = argc > 1 ? atoi(argv[1]) : 2000;
+    unsigned seed = argc > 2 ? atoi(argv[2]) : 1;
+
+    Document doc(genSource(400));
+    size_t start_size = doc.text.size();
+    Editor editor(seed, start_size);
+    double edit_ms = 0, rebuild_ms = 0;
+    size_t rescanned = 0, reparsed = 0, mismatches = 0;
+    for (int n = 0; n < nedits;) {
+        size_t offset, removed;
+        std::string inserted;
+        if (not editor.pick(doc, offset, removed, inserted))
+            continue;
+        n++;
+
+        auto starttime = getTime();
+        doc.applyEdit(offset, removed, inserted);
+        edit_ms += timeSinceMilli(starttime);
+        rescanned += doc.last_rescanned;
+        reparsed += doc.last_reparsed;
+
+        starttime = getTime();
+        Document expected(doc.text);
+        rebuild_ms += timeSinceMilli(starttime);
+        if (const char* what = difference(doc, expected)) {
+            if (not mismatches)
+                fprintf(stderr, "edit %d at %zu (-%zu +%zu) differs in %s\n", n, offset, removed, inserted.size(), what);
+            mismatches++;
+        }
+    }
+
+    printf("input: %zu bytes, %zu after %d edits (seed %u)\n", start_size, doc.text.size(), nedits, seed);
+    printf("applyEdit : %8.4f ms/edit  %6.1f tokens rescanned, %.2f stmts reparsed\n",
+           edit_ms / nedits,
+           double(rescanned) / nedits,
+           double(reparsed) / nedits);
+    printf("rebuild   : %8.4f ms/edit  (%.1fx)\n", rebuild_ms / nedits, rebuild_ms / edit_ms);
+    printf("%zu of %d edits %s\n", nedits - mismatches, nedits, mismatches ? "MISMATCH" : "identical");
+    return mismatches ? 1 : 0;
+}
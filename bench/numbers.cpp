@@ -0,0 +1,101 @@
+// Numeric literal microbenchmark
+//
+// usage: bin/bench_numbers [nlines] [reps]
+//
+// Compares decoding number literals the old way (copy the spelling into a
+// std::string, then atof in the parser) against the scanner's from_chars
+// decode, and times scan + parse of a number-heavy input end to end.
+
+#include <charconv>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "parse.hpp"
+#include "scan.hpp"
+#include "time.hpp"
+
+// number-heavy input: integers, fractions, exponents and hex
+std::string genSource(int nlines) {
+    static const char* nums[] = {"1", "42", "3.25", "1000000", "6.02e23", "0x1F", "1.5E-3",
+                                 "7", "0.001", "123456.789", "9e9", "0xDEADBEEF", "2.5", "10"};
+    constexpr int nnums = sizeof(nums) / sizeof(nums[0]);
+    std::string src;
+    for (int i = 0; i < nlines; i++) {
+        src += "var x = ";
+        for (int j = 0; j < 6; j++) {
+            src += nums[(i * 5 + j * 3) % nnums];
+            src += j < 5 ? (j % 2 ? " * " : " + ") : ";\n";
+        }
+    }
+    return src;
+}
+
+int main(int argc, char** argv) {
+    int nlines = argc > 1 ? atoi(argv[1]) : 100000;
+    int reps = argc > 2 ? atoi(argv[2]) : 5;
+    std::string src = genSource(nlines);
+
+    Scanner scanner(src.c_str());
+    TokenBuffer tokens = scanner.scan();
+    std::vector<std::string_view> spellings;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        if (tokens.type(i) == NUM)
+            spellings.push_back(tokens[i].str);
+    }
+
+    double old_sum = 0, new_sum = 0;
+    auto starttime = getTime();
+    for (int r = 0; r < reps; r++)
+        for (auto& str : spellings)
+            old_sum += atof(std::string(str).c_str());
+    double atof_ms = timeSinceMilli(starttime) / reps;
+
+    starttime = getTime();
+    for (int r = 0; r < reps; r++) {
+        for (auto& str : spellings) {
+            double num = 0;
+            if (str.size() > 2 and str[1] == 'x')
+                std::from_chars(str.data() + 2, str.data() + str.size(), num, std::chars_format::hex);
+            else
+                std::from_chars(str.data(), str.data() + str.size(), num);
+            new_sum += num;
+        }
+    }
+    double from_chars_ms = timeSinceMilli(starttime) / reps;
+
+    // values the scanner stored must match what atof gives
+    size_t mismatches = 0;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        if (tokens.type(i) == NUM)
+            mismatches += tokens.num(i) != atof(std::string(tokens[i].str).c_str());
+    }
+
+    printf("input: %zu bytes, %zu tokens, %zu numbers\n",
+           src.size(),
+           tokens.size(),
+           spellings.size());
+    printf("string + atof       : %8.3f ms  %8.2f Mnum/s\n",
+           atof_ms,
+           spellings.size() / atof_ms / 1e3);
+    printf("from_chars          : %8.3f ms  %8.2f Mnum/s  (%.1fx)\n",
+           from_chars_ms,
+           spellings.size() / from_chars_ms / 1e3,
+           atof_ms / from_chars_ms);
+
+    starttime = getTime();
+    size_t nstmts = 0;
+    for (int r = 0; r < reps; r++) {
+        Scanner s(src.c_str());
+        Arena arena;
+        Parser parser(s, arena);
+        nstmts += parser.ParseStatements().size();
+    }
+    double parse_ms = timeSinceMilli(starttime) / reps;
+    printf("scan + parse        : %8.3f ms  %8.2f MB/s\n", parse_ms, src.size() / parse_ms / 1e3);
+
+    bool ok = old_sum == new_sum and mismatches == 0 and nstmts == size_t(reps * nlines);
+    if (not ok)
+        fprintf(stderr, "decoded values differ!\n");
+    return not ok;
+}
@@ -0,0 +1,123 @@
+// Register VM benchmark
+//
+// usage: bin/bench_regvm [nstmts] [reps]
+//
+// Compiles a generated arithmetic-heavy script of nstmts statements (default
+// 5000) to stack code, peephole optimized, and to register code, then runs
+// each reps times (default 20) on VM::exec() and VM::execRegs(). Reports the
+// instructions executed and the time per run, and checks that both leave the
+// same value in every top-level variable.
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "codegen.hpp"
+#include "expr.hpp"
+#include "fold.hpp"
+#include "parse.hpp"
+#include "peephole.hpp"
+#include "regcodegen.hpp"
+#include "scan.hpp"
+#include "time.hpp"
+#include "vm.hpp"
+
+// each var mixes the two before it, every fourth through a call
+std::string genSource(int nstmts) {
+    std::string src = "fn mix(x, y) {\n"
+                      "    var s = x * 0.5 - y / 4 + 1;\n"
+                      "    var t = (s - x) * (s + y) / 8 - -(s - y);\n"
+                      "    ret t * 0.25 - s * 0.125 + (x cmp y);\n"
+                      "};\n"
+                      "var a0 = 1.5;\n"
+                      "var a1 = 2;\n";
+    for (int i = 2; i < nstmts; i++) {
+        std::string a = "a" + std::to_string(i - 1), b = "a" + std::to_string(i - 2);
+        std::string rhs = "(" + a + " * 0.5 + " + b + " * 0.25 - 1.5) / 1.25";
+        if (i % 4 == 0)
+            rhs += " + mix(" + a + ", " + std::to_string(i % 10) + ")";
+        else if (i % 4 == 1)
+            rhs += " - -(" + a + " - " + b + ") * 0.75 + !(" + a + " cmp " + b + ")";
+        else
+            rhs += " * (" + b + " - 2 * " + a + " + 3) / 16";
+        src += "var a" + std::to_string(i) + " = " + rhs + ";\n";
+    }
+    return src;
+}
+
+struct Result {
+    long icount = 0;
+    double ms = 0;
+};
+
+// run code reps times after a first run that compiles the fn bodies
+Result timeRuns(VM& vm, const Chunk& code, int reps) {
+    vm.trace = false;
+    vm.load(code);
+    Result res;
+    auto exec = [&vm, &code]() { return code.registers ? vm.execRegs() : vm.exec(); };
+    if (exec() != VMStatus::OK)
+        fprintf(stderr, RED "%s code did not run to completion\n" RESET, code.registers ? "register" : "stack");
+    for (int r = 0; r < reps; r++) {
+        auto starttime = getTime();
+        exec();
+        res.ms += timeSinceMilli(starttime) / reps;
+    }
+    res.icount = vm.icount;
+    return res;
+}
+
+int main(int argc, char** argv) {
+    int nstmts = argc > 1 ? atoi(argv[1]) : 5000;
+    int reps = argc > 2 ? atoi(argv[2]) : 20;
+    std::string src = genSource(nstmts);
+
+    TokenBuffer tokens = Scanner(src.c_str(), src.size()).scan();
+    Arena arena;
+    Parser parser(tokens, arena);
+    std::vector<Expr*> stmts = parser.ParseStatements();
+    Folder(arena).foldProgram(stmts);
+
+    FnTable stack_fns, reg_fns;
+    GlobalTable globals;
+    stack_fns.compile = CodeGen::compileBody;
+    reg_fns.compile = RegCodeGen::compileBody;
+    Chunk stack_code, reg_code;
+    stack_code.fns = &stack_fns;
+    stack_code.globals = &globals;
+    reg_code.fns = &reg_fns;
+    reg_code.globals = &globals;
+    reg_code.registers = true;
+    for (auto stmt : stmts) {
+        stmt->codegen(stack_code);
+        stack_code.addOp(OP_POP);
+        RegCodeGen::operand(stmt, reg_code, 0);
+    }
+    Peephole(2).run(stack_code);
+
+    VM stack_vm, reg_vm;
+    Result stack = timeRuns(stack_vm, stack_code, reps);
+    Result regs = timeRuns(reg_vm, reg_code, reps);
+
+    printf("input: %zu bytes, %d statements, %d reps\n", src.size(), nstmts, reps);
+    printf("stack    : %8zu bytes  %9ld instrs  %8.3f ms\n", stack_code.size(), stack.icount, stack.ms);
+    printf("register : %8zu bytes  %9ld instrs  %8.3f ms  (%u registers)\n",
+           reg_code.size(),
+           regs.icount,
+           regs.ms,
+           reg_code.nregs);
+    printf("register/stack: %.2fx instrs, %.2fx time\n",
+           double(regs.icount) / stack.icount,
+           regs.ms / stack.ms);
+
+    // every top-level var must come out the same
+    bool same = true;
+    for (size_t slot = 0; slot < globals.size(); slot++) {
+        std::string name = globals.name(slot);
+        Value* a = stack_vm.global(name);
+        Value* b = reg_vm.global(name);
+        same &= a and b and a->tostr() == b->tostr();
+    }
+    printf("%zu vars %s\n", globals.size(), same ? "identical" : "MISMATCH");
+    return same ? 0 : 1;
+}
@@ -0,0 +1,149 @@
+// Scanner microbenchmark
+//
+// usage: bin/bench_scan [file] [reps]
+//
+// Measures identifier classification throughput of the keyword perfect hash
+// against the old per-keyword regex chain, whole-file scan throughput at
+// each available SIMD level, and token storage size.
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "re.hpp"
+#include "scan.hpp"
+#include "simd.hpp"
+#include "time.hpp"
+
+// previous implementation: one anchored slre match per keyword
+TokenType regexKeywordTokenType(const std::string& idstr) {
+    static const std::pair<const char*, TokenType> kws[] = {{"^and$", AND},
+                                                            {"^else$", ELSE},
+                                                            {"^cmp$", CMP},
+                                                            {"^fn$", FN},
+                                                            {"^for$", FOR},
+                                                            {"^var$", VAR},
+                                                            {"^if$", IF},
+                                                            {"^or$", OR},
+                                                            {"^print$", PRINT},
+                                                            {"^ret$", RET},
+                                                            {"^to$", TO},
+                                                            {"^True$", TRUE},
+                                                            {"^False$", FALSE}};
+    for (auto& kw : kws) {
+        if (re_match(idstr, kw.first))
+            return kw.second;
+    }
+    return ID;
+}
+
+std::string readFile(const char* filepath) {
+    std::string contents;
+    FILE* fp = fopen(filepath, "r");
+    if (not fp)
+        return contents;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        contents.append(buf, n);
+    fclose(fp);
+    return contents;
+}
+
+// identifier-heavy input: keywords mixed with plain names of varying length
+std::string genSource(int nlines) {
+    static const char* words[] = {
+        "var", "fn", "print", "alpha", "if", "else", "beta_2", "ret", "for", "to", "x",
+        "True", "counter", "False", "and", "or", "cmp", "some_longer_identifier"};
+    constexpr int nwords = sizeof(words) / sizeof(words[0]);
+    std::string src;
+    for (int i = 0; i < nlines; i++) {
+        for (int j = 0; j < 8; j++) {
+            src += words[(i * 7 + j * 3) % nwords];
+            src += ' ';
+        }
+        src += ";\n";
+    }
+    return src;
+}
+
+int main(int argc, char** argv) {
+    std::string src = argc > 1 ? readFile(argv[1]) : genSource(100000);
+    int reps = argc > 2 ? atoi(argv[2]) : 5;
+    if (src.empty()) {
+        fprintf(stderr, "could not read input\n");
+        return 1;
+    }
+
+    // collect identifier spellings once so that only classification is timed
+    Scanner scanner(src.c_str());
+    TokenBuffer tokens = scanner.scan();
+    std::vector<std::string> ids;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        Token tok = tokens[i];
+        if (tok.type == ID or isKeywordRepr(token_reprs[tok.type]))
+            ids.push_back(std::string(tok.str));
+    }
+    // force the lazy line index so it is counted below
+    tokens.lineno(tokens.size() - 1);
+
+    long checksum = 0;
+    auto starttime = getTime();
+    for (int r = 0; r < reps; r++)
+        for (auto& id : ids)
+            checksum += regexKeywordTokenType(id);
+    double regex_ms = timeSinceMilli(starttime) / reps;
+
+    starttime = getTime();
+    for (int r = 0; r < reps; r++)
+        for (auto& id : ids)
+            checksum -= lookupKeyword(id);
+    double hash_ms = timeSinceMilli(starttime) / reps;
+
+    printf("input: %zu bytes, %zu tokens, %zu identifiers (checksum %ld)\n",
+           src.size(),
+           tokens.size(),
+           ids.size(),
+           checksum);
+    printf("keyword regex chain : %8.3f ms  %8.2f Mid/s\n", regex_ms, ids.size() / regex_ms / 1e3);
+    printf("keyword perfect hash: %8.3f ms  %8.2f Mid/s  (%.1fx)\n",
+           hash_ms,
+           ids.size() / hash_ms / 1e3,
+           regex_ms / hash_ms);
+
+    SimdLevel default_level = getSimdLevel();
+    for (SimdLevel level : {SimdLevel::SCALAR, SimdLevel::SSE2, SimdLevel::AVX2}) {
+        if (not setSimdLevel(level))
+            continue;
+        starttime = getTime();
+        size_t ntokens = 0;
+        for (int r = 0; r < reps; r++) {
+            Scanner s(src.c_str());
+            ntokens += s.scan().size();
+        }
+        double scan_ms = timeSinceMilli(starttime) / reps;
+        printf("full scan [%-6s]   : %8.3f ms  %8.2f MB/s\n",
+               simdLevelStr(level),
+               scan_ms,
+               src.size() / scan_ms / 1e3);
+        checksum += ntokens - reps * tokens.size();
+    }
+    setSimdLevel(default_level);
+
+    // previous Token layout: owning string + type + line/pos per token
+    struct OwningToken {
+        TokenType type;
+        std::string str;
+        int lineno;
+        int linepos;
+    };
+    size_t owning_bytes = tokens.size() * sizeof(OwningToken);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        if (tokens.lengths[i] > 15) // exceeds libstdc++ small string buffer
+            owning_bytes += tokens.lengths[i] + 1;
+    }
+    printf("token memory        : %8.2f MB (owning tokens: %.2f MB)\n",
+           tokens.bytesUsed() / 1e6,
+           owning_bytes / 1e6);
+    return checksum != 0;
+}
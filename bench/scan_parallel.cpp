@@ -0,0 +1,120 @@
+// Parallel scanner benchmark
+//
+// usage: bin/bench_scan_parallel [file] [reps]
+//
+// Scans a large input serially and with Scanner::scanParallel() at
+// increasing thread counts, checking that every result matches the serial
+// token buffer. Without a file, runs on test03 repeated to ~40 MB, and on a
+// generated input of multi-line strings and comments holding quotes, where
+// chunks start inside string literals and have to be rescanned and stitched.
+// That input must need rescanning at every thread count above 1.
+
+#include <cstdio>
+#include <string>
+
+#include "pool.hpp"
+#include "scan.hpp"
+#include "time.hpp"
+
+std::string readFile(const char* filepath) {
+    std::string contents;
+    FILE* fp = fopen(filepath, "r");
+    if (not fp)
+        return contents;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        contents.append(buf, n);
+    fclose(fp);
+    return contents;
+}
+
+bool sameTokens(const TokenBuffer& a, const TokenBuffer& b) {
+    return a.types == b.types and a.offsets == b.offsets and a.lengths == b.lengths and
+           a.num_tokens == b.num_tokens and a.nums == b.nums;
+}
+
+// string literals spanning lines, holding '#', braces and an apostrophe the
+// scanner rejects outside strings; comments holding odd quotes
+std::string genStrings(size_t size) {
+    std::string src;
+    for (size_t i = 0; src.size() < size; i++) {
+        std::string n = std::to_string(i);
+        src += "var s" + n + " = \"line one of " + n + "\n";
+        src += "    # not a comment, { nor a block ;\n";
+        for (size_t k = 0; k < i % 5; k++)
+            src += "    it's line " + std::to_string(k + 2) + "\n";
+        src += "\";\n";
+        src += "# a comment with a \"quote, and " + std::string(i % 3, '"') + "more\n";
+        src += "print s" + n + " cmp \"x\"; # trailing \"comment\n";
+        src += "fn f" + n + "(a) { ret a * 2.5 + 0x1F; };\n";
+    }
+    return src;
+}
+
+// time scanParallel() on src at each thread count; false if any result
+// differs from the serial scan, or if need_resyncs and none was rescanned
+bool run(const char* name, const std::string& src, int reps, bool need_resyncs) {
+    Scanner serial_scanner(src.c_str(), src.size());
+    TokenBuffer expected = serial_scanner.scan();
+
+    auto starttime = getTime();
+    for (int r = 0; r < reps; r++) {
+        Scanner s(src.c_str(), src.size());
+        s.scan();
+    }
+    double serial_ms = timeSinceMilli(starttime) / reps;
+
+    printf("%s: %zu bytes, %zu tokens, %d hardware threads\n",
+           name,
+           src.size(),
+           expected.size(),
+           defaultJobs());
+    printf("serial     : %8.3f ms  %8.2f MB/s\n", serial_ms, src.size() / serial_ms / 1e3);
+
+    bool ok = true;
+    for (int jobs = 1; jobs <= std::max(8, defaultJobs()); jobs *= 2) {
+        TokenBuffer tokens(src.c_str(), src.size());
+        size_t resyncs = 0;
+        starttime = getTime();
+        for (int r = 0; r < reps; r++) {
+            Scanner s(src.c_str(), src.size());
+            tokens = s.scanParallel(jobs);
+            resyncs = s._resyncs;
+        }
+        double ms = timeSinceMilli(starttime) / reps;
+        bool same = sameTokens(tokens, expected);
+        ok &= same and (jobs == 1 or resyncs or not need_resyncs);
+        printf("jobs = %-3d : %8.3f ms  %8.2f MB/s  speedup %.2fx  %zu resyncs  %s\n",
+               jobs,
+               ms,
+               src.size() / ms / 1e3,
+               serial_ms / ms,
+               resyncs,
+               same ? "identical" : "MISMATCH");
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int reps = argc > 2 ? atoi(argv[2]) : 3;
+    if (argc > 1) {
+        std::string src = readFile(argv[1]);
+        if (src.empty()) {
+            fprintf(stderr, "could not read input\n");
+            return 1;
+        }
+        return run(argv[1], src, reps, false) ? 0 : 1;
+    }
+
+    std::string unit = readFile("test/input/test03"), src;
+    while (not unit.empty() and src.size() < 40000000)
+        src += unit;
+    if (src.empty()) {
+        fprintf(stderr, "could not read input\n");
+        return 1;
+    }
+    bool ok = run("test03", src, reps, false);
+    ok &= run("strings", genStrings(16000000), reps, true);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,198 @@
+// Front end startup benchmark
+//
+// usage: bin/bench_startup [file] [reps]
+//
+// Time from source text to bytecode for the two front ends: scan into a
+// TokenBuffer, parse into an AST and compile it, versus the single-pass
+// Compiler driving the Scanner directly. The AST is compiled twice: per
+// statement and unfolded, which must give the Compiler's chunks exactly, and
+// through the real pipeline, folded and peephole optimized into one chunk by
+// CodeGen. Those differ in their bytecode, so both programs are run and must
+// leave every top-level var the same. Runs on a small script and a large one
+// (or on file, if given).
+
+#include <cstdio>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "codegen.hpp"
+#include "compile.hpp"
+#include "expr.hpp"
+#include "fold.hpp"
+#include "parse.hpp"
+#include "peephole.hpp"
+#include "scan.hpp"
+#include "time.hpp"
+
+// vars, then arithmetic, var and print statements; everything here has codegen
+std::string genSource(int nlines) {
+    static const char* exprs[] = {"1 + 2 * 3",
+                                  "(a + b) / 2.5",
+                                  "-4 * (x - 1e3)",
+                                  "!True or False and ok",
+                                  "\"str\" cmp name",
+                                  "0x1F * (10 - 2) / 4 + -(7 * 8)"};
+    constexpr int nexprs = sizeof(exprs) / sizeof(exprs[0]);
+    std::string src = "var a = 3;\nvar b = 0.5;\nvar x = 12;\nvar ok = True;\nvar name = \"str\";\n";
+    for (int i = 0; i < nlines; i++) {
+        const char* expr = exprs[i % nexprs];
+        if (i % 3 == 0)
+            src += "var v" + std::to_string(i) + " = " + expr + ";\n";
+        else if (i % 3 == 1)
+            src += std::string("print ") + expr + ";\n";
+        else
+            src += std::string(expr) + ";\n";
+    }
+    return src;
+}
+
+std::string readFile(const char* filepath) {
+    std::string contents;
+    FILE* fp = fopen(filepath, "r");
+    if (not fp)
+        return contents;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        contents.append(buf, n);
+    fclose(fp);
+    return contents;
+}
+
+std::vector<Chunk> viaAst(const std::string& src) {
+    std::vector<Chunk> chunks;
+    TokenBuffer tokens = Scanner(src.c_str(), src.size()).scan();
+    Arena arena;
+    Parser parser(tokens, arena);
+    auto statements = parser.ParseStatements();
+    FnTable fns; // fn bodies are left uncompiled, as in the Compiler
+    GlobalTable globals;
+    chunks.resize(statements.size());
+    for (size_t i = 0; i < statements.size(); i++) {
+        chunks[i].fns = &fns;
+        chunks[i].globals = &globals;
+        statements[i]->codegen(chunks[i]);
+        chunks[i].addOp(OP_POP);
+    }
+    return chunks;
+}
+
+std::vector<Chunk> viaCompiler(const std::string& src) {
+    std::vector<Chunk> chunks;
+    Scanner scanner(src.c_str(), src.size());
+    Compiler compiler(scanner);
+    while (compiler.compileStatement(chunks.emplace_back()))
+        chunks.back().addOp(OP_POP);
+    chunks.pop_back();
+    return chunks;
+}
+
+// the real pipeline: parse, fold and compile the program into one chunk
+void viaCodeGen(const std::string& src) {
+    TokenBuffer tokens = Scanner(src.c_str(), src.size()).scan();
+    Arena arena;
+    Parser parser(tokens, arena);
+    auto statements = parser.ParseStatements();
+    if (fold_constants)
+        Folder(arena).foldProgram(statements);
+    CodeGen(statements).compile();
+}
+
+// Run src through CodeGen's pipeline, and statement by statement through the
+// Compiler as Compiler::genCode() does. Both must run to completion and
+// leave every top-level var the same. The programs' prints are discarded.
+bool sameResults(const std::string& src) {
+    TokenBuffer tokens = Scanner(src.c_str(), src.size()).scan();
+    Arena arena;
+    Parser parser(tokens, arena);
+    auto statements = parser.ParseStatements();
+    if (fold_constants)
+        Folder(arena).foldProgram(statements);
+    CodeGen codegen(statements);
+    VM whole;
+    whole.trace = false;
+    whole.load(codegen.compile());
+
+    Scanner scanner(src.c_str(), src.size());
+    Compiler compiler(scanner);
+    VM stepwise;
+    stepwise.trace = false;
+
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    bool ok = whole.exec() == VMStatus::OK;
+    Chunk code;
+    Peephole peephole;
+    while (compiler.compileStatement(code)) {
+        code.addOp(OP_POP);
+        peephole.run(code);
+        stepwise.load(code);
+        ok &= stepwise.exec() == VMStatus::OK;
+        code = Chunk();
+    }
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(devnull);
+    close(saved_stdout);
+
+    for (size_t slot = 0; slot < codegen.globals.size(); slot++) {
+        std::string name = codegen.globals.name(slot);
+        Value* a = whole.global(name);
+        Value* b = stepwise.global(name);
+        ok &= a and b and a->tostr() == b->tostr();
+    }
+    return ok and codegen.globals.size() == compiler.globals.size();
+}
+
+// returns false if the front ends disagree
+bool run(const char* name, const std::string& src, int reps) {
+    // alternate the three so all see the same heap and cache state
+    std::vector<Chunk> ast_chunks, single_chunks;
+    double ast_ms = 0, codegen_ms = 0, single_ms = 0;
+    for (int r = 0; r < reps; r++) {
+        auto starttime = getTime();
+        ast_chunks = viaAst(src);
+        ast_ms += timeSinceMilli(starttime) / reps;
+
+        starttime = getTime();
+        viaCodeGen(src);
+        codegen_ms += timeSinceMilli(starttime) / reps;
+
+        starttime = getTime();
+        single_chunks = viaCompiler(src);
+        single_ms += timeSinceMilli(starttime) / reps;
+    }
+    bool same_chunks = ast_chunks == single_chunks;
+    bool same_results = sameResults(src);
+
+    printf("%s: %zu bytes, %zu statements\n", name, src.size(), ast_chunks.size());
+    printf("  scan + parse + codegen         : %9.4f ms  chunks %s\n",
+           ast_ms,
+           same_chunks ? "identical" : "DIFFER");
+    printf("  ... + fold + peephole, 1 chunk : %9.4f ms  results %s\n",
+           codegen_ms,
+           same_results ? "identical" : "DIFFER");
+    printf("  single pass                    : %9.4f ms  (%.2fx, %.2fx)\n",
+           single_ms,
+           ast_ms / single_ms,
+           codegen_ms / single_ms);
+    return same_chunks and same_results;
+}
+
+int main(int argc, char** argv) {
+    int reps = argc > 2 ? atoi(argv[2]) : 0;
+    bool ok = true;
+    if (argc > 1) {
+        ok = run(argv[1], readFile(argv[1]), reps ? reps : 10);
+    } else {
+        ok &= run("small", genSource(20), reps ? reps : 2000);
+        ok &= run("large", genSource(100000), reps ? reps : 5);
+    }
+    if (not ok)
+        fprintf(stderr, "front ends differ!\n");
+    return not ok;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Fixed-size array of T living in an Arena
+template <typename T>
+struct ArenaArray {
+    T* items = nullptr;
+    size_t len = 0;
+
+    T* begin() const { return items; }
+    T* end() const { return items + len; }
+    size_t size() const { return len; }
+    T& operator[](size_t i) const { return items[i]; }
+};
+
+// Bump allocator. Objects are placed back to back in blocks that double in
+// size (up to max_block_size), and are all freed together by reset() or
+// the destructor; destructors of allocated objects are never run.
+struct Arena {
+    static constexpr size_t max_block_size = 1 << 20;
+
+    // nothing is allocated until the first alloc()
+    Arena(size_t first_block_size = 1 << 16) : next_block_size(first_block_size) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    Arena(Arena&& other) noexcept { *this = std::move(other); }
+    Arena& operator=(Arena&& other) noexcept {
+        std::swap(blocks, other.blocks);
+        std::swap(ptr, other.ptr);
+        std::swap(end, other.end);
+        std::swap(next_block_size, other.next_block_size);
+        std::swap(used, other.used);
+        return *this;
+    }
+    ~Arena() {
+        for (auto& block : blocks)
+            free(block.first);
+    }
+
+    void* alloc(size_t sz, size_t align = alignof(std::max_align_t)) {
+        char* p = (char*)((uintptr_t(ptr) + align - 1) & ~uintptr_t(align - 1));
+        if (p + sz > end or not ptr)
+            p = grow(sz, align);
+        ptr = p + sz;
+        used += sz;
+        return p;
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena objects are never destroyed");
+        return new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // copy of items[0:n]
+    template <typename T>
+    ArenaArray<T> array(const T* items, size_t n) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T* copy = (T*)alloc(n * sizeof(T), alignof(T));
+        if (n)
+            memcpy(copy, items, n * sizeof(T));
+        return {copy, n};
+    }
+
+    // copy of str that lives as long as the arena
+    std::string_view str(std::string_view str) {
+        char* copy = (char*)alloc(str.size(), 1);
+        if (str.size())
+            memcpy(copy, str.data(), str.size());
+        return std::string_view(copy, str.size());
+    }
+
+    // free everything but the most recent block, which is kept for reuse
+    void reset() {
+        if (blocks.empty())
+            return;
+        for (size_t i = 0; i + 1 < blocks.size(); i++)
+            free(blocks[i].first);
+        blocks.erase(blocks.begin(), blocks.end() - 1);
+        ptr = blocks[0].first;
+        end = ptr + blocks[0].second;
+        used = 0;
+    }
+
+    // bytes handed out since construction or the last reset()
+    size_t bytesUsed() const { return used; }
+    size_t bytesReserved() const {
+        size_t total = 0;
+        for (auto& block : blocks)
+            total += block.second;
+        return total;
+    }
+
+    char* grow(size_t sz, size_t align) {
+        size_t block_size = next_block_size;
+        if (next_block_size < max_block_size)
+            next_block_size *= 2;
+        if (block_size < sz + align)
+            block_size = sz + align;
+        char* block = (char*)malloc(block_size);
+        if (not block)
+            throw std::bad_alloc();
+        blocks.push_back({block, block_size});
+        end = block + block_size;
+        return (char*)((uintptr_t(block) + align - 1) & ~uintptr_t(align - 1));
+    }
+
+    std::vector<std::pair<char*, size_t>> blocks; // (block, size)
+    char* ptr = nullptr;
+    char* end = nullptr;
+    size_t next_block_size = 1 << 16;
+    size_t used = 0;
+};
@@ -4,6 +4,41 @@ constexpr bool debug_vmstack = true;
 constexpr bool dump_token_stream = false;
 constexpr bool scanVerbose = false;
 constexpr bool parseVerbose = false;
+// log each constant a Chunk adds to its pool
+constexpr bool codegenVerbose = false;
+// pretty print the parsed AST before compiling it
+constexpr bool dump_ast = true;
 
 constexpr bool run_scan = true;
 constexpr bool run_parse = true;
+// pull tokens from the scanner as the parser needs them instead of scanning
+// the whole file into a TokenBuffer first
+constexpr bool stream_tokens = true;
+// print and compile from a flattened copy of the AST (flat.hpp) instead of
+// the pointer tree
+constexpr bool flat_ast = false;
+// compile straight from the token stream to bytecode (compile.hpp), with no
+// AST; skips the parser output dump
+constexpr bool single_pass = false;
+// parse operator chains with an explicit stack instead of recursion, so
+// deeply nested generated code can't overflow the native stack
+constexpr bool iterative_parse = true;
+// record fn bodies as source ranges and only parse and compile them on their
+// first call; bodies of functions never called are never checked. Streamed
+// stdin has no stable source to go back to, so it compiles them eagerly
+constexpr bool lazy_fn_bodies = true;
+// compile all recorded fn bodies before running, on this many threads (-1 for
+// one per hardware thread), instead of each on its first call; 0 is off
+constexpr int fn_codegen_jobs = 0;
+// fold constant subexpressions and propagate vars defined once to a literal
+// before codegen (fold.hpp); the single-pass Compiler has no AST to fold
+constexpr bool fold_constants = true;
+// bytecode peephole optimizations (peephole.hpp): 0 is off, 1 only drops
+// instructions that cancel out, 2 also evaluates ops on constants and drops
+// code after a RET
+constexpr int opt_level = 2;
+// compile to register code (regcodegen.hpp), run by VM::execRegs(), instead
+// of stack code; the single-pass Compiler only emits stack code
+constexpr bool register_vm = false;
+// VM gives up on a run after this many instructions (runaway recursion)
+constexpr long vm_max_icount = 1 << 24;
@@ -16,24 +16,116 @@
 #include "re.hpp"
 #include "scan.hpp"
 #include "expr.hpp"
+#include "flat.hpp"
+#include "fold.hpp"
+#include "parse.hpp"
+#include "peephole.hpp"
+#include "pool.hpp"
+#include "time.hpp"
 #include "vm.hpp"
 
+// The statements are compiled into one Chunk and run by one VM. The VM and
+// fns are kept, so variables and functions stay defined for later calls to
+// genCode().
 struct CodeGen {
-    CodeGen(std::vector<Expr*>& stmts): stmts(stmts) { }
+    CodeGen(std::vector<Expr*>& stmts): stmts(&stmts) { fns.compile = compileBody; }
+    CodeGen(const FlatAst& flat): flat(&flat) { fns.compile = compileBody; }
 
     Chunk genCode(){
+        Chunk code = compile();
+        if (opt_level)
+            peephole_stats.print();
+        vm.run(code);
+        return code; 
+    }
+
+    // the program's bytecode, optimized but not run
+    Chunk compile() {
         Chunk code;
-        for (const auto stmtexpr : stmts){
-            Chunk exprcode;
+        code.fns = &fns;
+        code.globals = &globals;
+        size_t nstmts = flat ? flat->roots.size() : stmts->size();
+        for (size_t i = 0; i < nstmts; i++){
             // expr should always leave stack idx at +1
-            stmtexpr->codegen(exprcode);
+            if (flat)
+                flat->codegen(flat->roots[i], code);
+            else
+                (*stmts)[i]->codegen(code);
             // ... so pop at end of stmt to restore stack
-            exprcode.addOp(OP_POP);
-            VM vm(exprcode);
-            vm.run();
+            code.addOp(OP_POP);
         }
-        return code; 
+        if (fn_codegen_jobs) {
+            auto starttime = getTime();
+            int jobs = fn_codegen_jobs < 0 ? defaultJobs() : fn_codegen_jobs;
+            size_t nfns = compileFns(code, jobs);
+            printf(YELLOW "Fn CodeGen took %.3g ms for %zu bodies on %d threads\n" RESET,
+                   timeSinceMilli(starttime),
+                   nfns,
+                   jobs);
+        }
+        if (opt_level) {
+            Peephole peephole;
+            peephole.run(code);
+            peephole_stats = peephole.stats;
+        }
+        return code;
+    }
+
+    // Compile every uncompiled fn body defined by code, and by the bodies
+    // compiled along the way, on up to jobs threads. Returns how many were
+    // compiled. A body compiles into its own FnProto and reads nothing else
+    // that is written meanwhile, so the result is the same as compiling them
+    // one by one, whatever order they finish in; the top-level vars a round
+    // adds get their slots after it, in order. Bodies are left for genCode's
+    // Peephole pass.
+    static size_t compileFns(Chunk& code, int jobs) {
+        std::vector<FnProto*> todo;
+        auto addUncompiled = [&todo](Chunk& chunk) {
+            for (auto& fn : chunk.protos)
+                if (not fn->compiled)
+                    todo.push_back(fn.get());
+        };
+        addUncompiled(code);
+
+        // bodies defining fns of their own add another round
+        size_t ncompiled = 0;
+        while (todo.size()) {
+            std::vector<FnProto*> round;
+            round.swap(todo);
+            for (auto fn : round)
+                fn->code.defer_globals = fn->code.globals != nullptr;
+            parallelFor(round.size(), jobs, [&round](size_t i) { genBody(*round[i]); });
+            for (auto fn : round) {
+                fn->code.bindGlobals();
+                addUncompiled(fn->code);
+            }
+            ncompiled += round.size();
+        }
+        return ncompiled;
+    }
+
+    // FnTable::compile for a body the parser skipped, run on its first call
+    static void compileBody(FnProto& fn) {
+        genBody(fn);
+        Peephole().run(fn.code);
+    }
+    // bytecode for a body the parser skipped, unoptimized
+    static void genBody(FnProto& fn) {
+        Scanner scanner(fn.source.data(), fn.source.size(), fn.begin, fn.end);
+        Arena arena(1 << 12);
+        Parser parser(scanner, arena);
+        Expr* body = parser.ParseExpr(0);
+        if (fold_constants)
+            body = Folder(arena).fold(body);
+        body->codegen(fn.code);
+        fn.code.addOp(OP_RET);
+        fn.compiled = true;
     }
 
-    std::vector<Expr*>& stmts;
+    std::vector<Expr*>* stmts = nullptr;
+    const FlatAst* flat = nullptr;
+    FnTable fns;
+    GlobalTable globals;
+    PeepholeStats peephole_stats; // of the last compile()
+    VM vm;
 };
@@ -0,0 +1,315 @@
+#pragma once
+
+#include <cassert>
+#include <cstdio>
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include "cfg.hpp"
+#include "color.hpp"
+#include "expr.hpp"
+#include "parse.hpp"
+#include "peephole.hpp"
+#include "scan.hpp"
+#include "util.hpp"
+#include "vm.hpp"
+
+// Single-pass front end: pulls tokens from the Scanner and emits bytecode
+// straight from the Pratt callbacks, without building Expr nodes. Uses the
+// Parser's precedences. compileStatement() emits the same code as Expr::codegen()
+// of the unfolded statement; with no AST there is no Folder pass, and
+// genCode() runs one peephole-optimized Chunk per statement where
+// CodeGen::genCode() runs the whole program as one. The results are the same.
+//
+// Constructs that have no codegen are reported as soon as they are reached.
+// Fn bodies are skipped and compiled on first call, as with the Parser's
+// lazy_bodies, unless the tokens come from a stream.
+struct Compiler;
+typedef void (*CompileFn)(Compiler&);
+// indexed by TokenType
+typedef std::array<CompileFn, NUM_TOKEN_TYPES> CompileTable;
+
+struct Compiler {
+    Compiler(Scanner& scanner) : tokens(scanner) { fns.compile = compileBody; }
+    Compiler(TokenStream tokens) : tokens(tokens) { fns.compile = compileBody; }
+
+    // run each statement as soon as it is compiled, all on one VM so
+    // variables and functions stay defined
+    void genCode() {
+        VM vm;
+        Chunk code;
+        Peephole peephole;
+        while (compileStatement(code)) {
+            // expr should always leave stack idx at +1, so pop at end of stmt
+            code.addOp(OP_POP);
+            peephole.run(code);
+            vm.run(code);
+            code = Chunk();
+        }
+        if (opt_level)
+            peephole.stats.print();
+    }
+
+    // compile the next statement into code; false once no statement is left
+    bool compileStatement(Chunk& code) {
+        if (endoftokens() or Parser::getPrefixPrec(currtype()) <= 0)
+            return false;
+        code.fns = &fns;
+        code.globals = &globals;
+        chunk = &code;
+        compileExpr(0);
+        terminateStatement();
+        return true;
+    }
+
+    // statement termination, as in Parser::ParseStatement()
+    void terminateStatement() {
+        if (endoftokens() and lasttype() != RIGHT_BRACE) {
+            fprintf(stderr, RED "Hit EOF without finding statement terminator (; or }) \n" RESET);
+            exit(1);
+        } else if (currtype() != SEMICOLON and lasttype() != RIGHT_BRACE) {
+            fprintf(stderr,
+                    RED "Expected stmt terminator *before* token on line %d, pos %d\n" RESET,
+                    tokens.lineno(currtoken()),
+                    tokens.linepos(currtoken()));
+            exit(1);
+        } else if (currtype() == SEMICOLON) {
+            consume();
+        }
+    }
+
+    // FnTable::compile for a body that was skipped, run on its first call
+    static void compileBody(FnProto& fn) {
+        Scanner scanner(fn.source.data(), fn.source.size(), fn.begin, fn.end);
+        Compiler c(scanner);
+        c.chunk = &fn.code;
+        c.compileExpr(0);
+        fn.code.addOp(OP_RET);
+        fn.compiled = true;
+        Peephole().run(fn.code);
+    }
+
+    // core Pratt routine; defined below the dispatch tables
+    void compileExpr(int precedence);
+
+    ///////////////////////////////////////////////////////////////////////////
+    // prefix functions
+    // NOTE: compile functions must consume what they use!
+    // variable read, or a call if followed by '('
+    static void compileName(Compiler& c) {
+        std::string name(c.consume().str);
+        if (c.currtype() == LEFT_PAREN) {
+            compileCall(c, name);
+            return;
+        }
+        c.chunk->addGetVar(name);
+    }
+    static void compileString(Compiler& c) { c.chunk->addConstStr(std::string(c.consume().str)); }
+    static void compileNum(Compiler& c) { c.chunk->addConstNum(c.consume().num); }
+    static void compileBool(Compiler& c) { c.chunk->addConstBool(c.consume().type == TRUE); }
+    static void compileUnaryOp(Compiler& c) {
+        TokenType type = c.consume().type;
+        c.compileExpr(Parser::getPrefixPrec(type));
+        c.chunk->addOp(token_to_unaryop.at(type));
+    }
+    static void compileGrouping(Compiler& c) {
+        c.consume(); // consume left paren
+        if (c.currtype() == RIGHT_PAREN)
+            c.unimplemented("()");
+        c.compileExpr(Parser::getPrefixPrec(LEFT_PAREN));
+        TokenType right_paren = c.consume().type; // consume right paren
+        assert(right_paren && "expected paren when parsing call expr");
+    }
+    static void compilePrint(Compiler& c) {
+        c.consume();
+        c.compileExpr(0);
+        c.chunk->addOp(OP_PRINT);
+    }
+    static void compileReturn(Compiler& c) {
+        c.consume();
+        c.compileExpr(Parser::getPrefixPrec(RET));
+        c.chunk->addOp(OP_RET);
+    }
+    // each statement is popped, the block's value is null
+    static void compileBlock(Compiler& c) {
+        c.consume(); // consume brace
+        while (not c.endoftokens() and Parser::getPrefixPrec(c.currtype()) > 0) {
+            c.compileExpr(0);
+            c.terminateStatement();
+            c.chunk->addOp(OP_POP);
+        }
+        TokenType right_brace = c.consume().type; // consume brace
+        assert(right_brace == RIGHT_BRACE && "expected closing right-brace when parsing block expr");
+        c.chunk->addConstNull();
+    }
+    // fn name (params) {body}; OP_DEFINE_FN binds the name, the statement's value is null
+    static void compileFnDef(Compiler& c) {
+        c.consume();
+        if (c.currtype() != ID)
+            c.unimplemented("ill-formed fn");
+        std::string fn_name(c.consume().str);
+        if (c.currtype() != LEFT_PAREN)
+            c.unimplemented("ill-formed fn");
+        c.consume();
+        std::vector<std::string> params;
+        while (c.currtype() == ID) {
+            params.emplace_back(c.consume().str);
+            if (c.currtype() != COMMA)
+                break;
+            c.consume();
+        }
+        if (c.currtype() != RIGHT_PAREN)
+            c.unimplemented("ill-formed fn params");
+        c.consume();
+
+        FnProto& fn = c.chunk->defineFn(fn_name, std::move(params));
+        std::string_view source = c.tokens.source();
+        if (lazy_fn_bodies and source.size() and c.currtype() == LEFT_BRACE) {
+            fn.source = source;
+            fn.begin = c.currtoken().offset;
+            if (not c.tokens.skipBraces()) {
+                fprintf(stderr, RED "Hit EOF inside body of fn '%s'\n" RESET, fn_name.c_str());
+                exit(1);
+            }
+            fn.end = c.tokens.prev_tok.offset + 1;
+        } else {
+            Chunk* outer = c.chunk;
+            c.chunk = &fn.code;
+            c.compileExpr(0);
+            fn.code.addOp(OP_RET);
+            fn.compiled = true;
+            c.chunk = outer;
+        }
+    }
+    // var name [= expr]; the name constant is registered after the rhs code
+    static void compileVar(Compiler& c) {
+        c.consume();
+        if (c.currtype() != ID)
+            c.unimplemented("ill-formed var");
+        std::string varname(c.consume().str);
+        if (c.currtype() == EQUALS) {
+            c.consume();
+            c.compileExpr(Parser::getInfixPrec(EQUALS));
+            if (c.getInfixPrecedence() > 0)
+                c.unimplemented("ill-formed var");
+            c.chunk->addDefineVar(varname);
+        } else {
+            if (c.getInfixPrecedence() > 0)
+                c.unimplemented("ill-formed var");
+            c.chunk->addConstNull();
+            c.chunk->addDefineVar(varname);
+        }
+    }
+    static void prefixUnimplemented(Compiler& c) { c.unimplemented(token_to_repr[c.currtype()]); }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // infix functions; the left operand has already been emitted
+    static void compileBinaryOp(Compiler& c) {
+        TokenType type = c.consume().type;
+        c.compileExpr(Parser::getInfixPrec(type));
+        c.chunk->addOp(token_to_binop.at(type));
+    }
+    static void infixUnimplemented(Compiler& c) { c.unimplemented(token_to_repr[c.currtype()]); }
+
+    // name(args): args left to right, then OP_CALL name argc
+    static void compileCall(Compiler& c, const std::string& fn_name) {
+        c.consume(); // consume paren
+        int argc = 0;
+        while (c.currtype() != RIGHT_PAREN) {
+            c.compileExpr(Parser::getInfixPrec(COMMA));
+            argc++;
+            if (c.currtype() != COMMA)
+                break;
+            c.consume();
+        }
+        if (c.currtype() != RIGHT_PAREN)
+            c.unimplemented("ill-formed call");
+        c.consume();
+        ConstIdx name_idx = c.chunk->regConstVal<std::string>(fn_name);
+        c.chunk->addOp(OP_CALL, {uint32_t(name_idx), uint32_t(argc)});
+    }
+
+    void unimplemented(const char* what) {
+        ERR("codegen for '%s' on line %d, pos %d is UNIMPLEMENTED.\n",
+            what,
+            tokens.lineno(currtoken()),
+            tokens.linepos(currtoken()));
+    }
+
+    // accessors for the dispatch tables, defined below them
+    static CompileFn getPrefixFunc(TokenType toktype);
+    static CompileFn getInfixFunc(TokenType toktype);
+    Prec getInfixPrecedence() {
+        return endoftokens() ? PREC_NONE : Parser::getInfixPrec(currtype());
+    }
+
+    // token stream manipulation
+    const Token& consume() { return tokens.consume(); };
+    const Token& currtoken() { return tokens.curr(); };
+    TokenType currtype() { return tokens.currtype(); };
+    TokenType lasttype() { return tokens.lasttype(); };
+    bool endoftokens() { return tokens.eof(); };
+
+    // variables
+    TokenStream tokens;
+    Chunk* chunk = nullptr;
+    FnTable fns;
+    GlobalTable globals;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Compile dispatch tables
+//
+// Precedences come from the Parser's tables; these only hold the handlers.
+
+constexpr CompileTable makeCompilePrefixTable() {
+    CompileTable table = {};
+    for (auto& fn : table)
+        fn = &Compiler::prefixUnimplemented;
+    table[ID] = &Compiler::compileName;
+    table[STRING] = &Compiler::compileString;
+    table[NUM] = &Compiler::compileNum;
+    table[TRUE] = &Compiler::compileBool;
+    table[FALSE] = &Compiler::compileBool;
+    table[BANG] = &Compiler::compileUnaryOp;
+    table[MINUS] = &Compiler::compileUnaryOp;
+    table[LEFT_PAREN] = &Compiler::compileGrouping;
+    table[PRINT] = &Compiler::compilePrint;
+    table[RET] = &Compiler::compileReturn;
+    table[VAR] = &Compiler::compileVar;
+    table[LEFT_BRACE] = &Compiler::compileBlock;
+    table[FN] = &Compiler::compileFnDef;
+    return table;
+}
+
+// binary operators with an opcode in token_to_binop
+constexpr CompileTable makeCompileInfixTable() {
+    CompileTable table = {};
+    for (auto& fn : table)
+        fn = &Compiler::infixUnimplemented;
+    for (TokenType type : {PLUS, MINUS, MULT, DIV, OR, AND, CMP})
+        table[type] = &Compiler::compileBinaryOp;
+    return table;
+}
+
+static constexpr CompileTable compile_prefix_table = makeCompilePrefixTable();
+static constexpr CompileTable compile_infix_table = makeCompileInfixTable();
+
+inline CompileFn Compiler::getPrefixFunc(TokenType toktype) {
+    assert(toktype < NUM_TOKEN_TYPES);
+    return compile_prefix_table[toktype];
+}
+inline CompileFn Compiler::getInfixFunc(TokenType toktype) {
+    assert(toktype < NUM_TOKEN_TYPES);
+    return compile_infix_table[toktype];
+}
+
+inline void Compiler::compileExpr(int precedence) {
+    if (endoftokens())
+        unimplemented("(EMPTY)");
+    getPrefixFunc(currtype())(*this);
+    while (precedence < getInfixPrecedence())
+        getInfixFunc(currtype())(*this);
+}
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <unordered_map>
-#include <vector>
 
+#include "arena.hpp"
+#include "printer.hpp"
 #include "scan.hpp"
 #include "util.hpp"
 #include "vm.hpp"
@@ -27,9 +29,28 @@ const std::unordered_map<TokenType, OpCode> token_to_unaryop = {
 // fwd decl
 struct Parser;
 
-#define DEL_EXPR(expr)                                                                             \
-    if (expr != nullptr)                                                                           \
-        delete expr;
+// tag of each Expr subclass, for switch-based walks (see flat.hpp)
+enum class NodeKind : uint8_t {
+    EMPTY,
+    NAME,
+    STRING,
+    NUM,
+    BOOL,
+    UNARY_OP,
+    BINARY_OP,
+    CALL,
+    RETURN,
+    VAR,
+    SUBSCRIPT,
+    COMMA_LIST,
+    BLOCK,
+    FOR,
+    FN_DEF,
+    IF,
+    PRINT,
+    LAZY_BLOCK,
+    NUM_NODE_KINDS
+};
 
 struct BinaryOpExpr;
 struct UnaryOpExpr;
@@ -37,12 +58,24 @@ struct NameExpr;
 struct NumExpr;
 
 // Base Class
+//
+// Nodes are allocated in the Parser's Arena and freed with it, so they must
+// stay trivially destructible: strings are views into the arena and child
+// lists are ArenaArrays.
 struct Expr {
+    Expr(NodeKind kind) : kind(kind) {}
     void print(int depth = 0, bool semicolon = false) {
-        printf("%s%s\n\n", str().c_str(), semicolon ? ";" : "");
+        Printer out;
+        write(out, depth);
+        out.put(semicolon ? ";\n\n" : "\n\n").flush();
     }
     // pretty print expression at requested indentation
-    virtual std::string str(int depth = 0) { return "(UNIMPLEMENTED)"; }
+    virtual void write(Printer& out, int depth) { out.put("(UNIMPLEMENTED)"); }
+    std::string str(int depth = 0) {
+        Printer out;
+        write(out, depth);
+        return std::move(out.buf);
+    }
     virtual bool isNameExpr() { return false; }
     virtual bool isBinaryOpExpr() { return false; }
     virtual bool isUnaryOpExpr() { return false; }
@@ -51,70 +84,48 @@ struct Expr {
     NameExpr* asName();
     NumExpr* asNum();
     virtual void codegen(Chunk& code) { ERR("codegen for expr \n'%s' is UNIMPLEMENTED.\n",str(0).c_str()); }
-    virtual ~Expr();
-    std::string tabs(int depth) {
-        std::string tabs;
-        for (int i = 0; i < depth; i++)
-            tabs.append("    ");
-        return tabs;
-    }
+    NodeKind kind;
 };
-Expr::~Expr() {}
 
 struct EmptyExpr : Expr {
-    std::string str(int depth) { return tabs(depth) + "(EMPTY)"; }
+    EmptyExpr() : Expr(NodeKind::EMPTY) {}
+    void write(Printer& out, int depth) { out.indent(depth).put("(EMPTY)"); }
 };
 struct NameExpr : Expr {
-    NameExpr(std::string name) : name(std::move(name)) {}
+    NameExpr(std::string_view name) : Expr(NodeKind::NAME), name(name) {}
     bool isNameExpr() { return true; }
-    void codegen(Chunk& code) { code.addConstStr(name); }
-    std::string str(int depth) { return name; }
-    ~NameExpr() {}
+    void codegen(Chunk& code) {
+        code.addGetVar(std::string(name));
+    }
+    void write(Printer& out, int depth) { out.put(name); }
 
-    std::string name;
+    std::string_view name;
 };
 struct StringExpr : Expr {
-    StringExpr(std::string str) : string(str) {}
+    StringExpr(std::string_view str) : Expr(NodeKind::STRING), string(str) {}
     bool isStringExpr() { return true; }
-    void codegen(Chunk& code) { code.addConstStr(string); }
-    std::string str(int depth) { 
-        std::string str = BRIGHTBLUE;
-        str.append("\""); 
-        str.append(string); 
-        str.append("\""); 
-        str.append(RESET); 
-        return str;
-    }
-    ~StringExpr() {}
+    void codegen(Chunk& code) { code.addConstStr(std::string(string)); }
+    void write(Printer& out, int depth) { out.put(BRIGHTBLUE "\"").put(string).put("\"" RESET); }
 
-    std::string string;
+    std::string_view string;
 };
 struct NumExpr : Expr {
-    NumExpr(double num) : num(num) {}
+    NumExpr(double num) : Expr(NodeKind::NUM), num(num) {}
     void codegen(Chunk& code) { code.addConstNum(num); }
-    std::string str(int depth) {
-        char buf[200];
-        sprintf(buf, "%g", num);
-        return tabs(depth) + buf;
-    }
-    ~NumExpr() {}
+    void write(Printer& out, int depth) { out.indent(depth).num(num); }
 
     double num;
 };
 struct BoolExpr : Expr {
-    BoolExpr(bool val) : val(val) {}
+    BoolExpr(bool val) : Expr(NodeKind::BOOL), val(val) {}
     void codegen(Chunk& code) { code.addConstBool(val); }
-    std::string str(int depth) {
-        char buf[200];
-        sprintf(buf, "%s", val ? "True" : "False");
-        return tabs(depth) + buf;
-    }
-    ~BoolExpr() {}
+    void write(Printer& out, int depth) { out.indent(depth).put(val ? "True" : "False"); }
 
     bool val;
 };
 struct UnaryOpExpr : Expr {
-    UnaryOpExpr(TokenType type, Expr* right) : type(type), right(right) {
+    UnaryOpExpr(TokenType type, Expr* right)
+        : Expr(NodeKind::UNARY_OP), type(type), right(right) {
         assert(not right->isNameExpr());
     }
     void codegen(Chunk& code) {
@@ -128,18 +139,25 @@ struct UnaryOpExpr : Expr {
         }
     }
     virtual bool isUnaryOpExpr() { return true; }
-    std::string str(int depth) { return "(" + std::string(token_to_repr[type]) + right->str() + ")"; }
-    ~UnaryOpExpr() { DEL_EXPR(right); }
+    void write(Printer& out, int depth) {
+        out.put('(').put(token_to_repr[type]);
+        right->write(out, 0);
+        out.put(')');
+    }
 
     TokenType type;
     Expr* right;
 };
 struct BinaryOpExpr : Expr {
     BinaryOpExpr() = delete;
-    BinaryOpExpr(Expr* left, TokenType type, Expr* right) : left(left), type(type), right(right) {}
-    std::string str(int depth) {
-        return tabs(depth) + "(" + left->str() + " " + token_to_repr[type] + " " + right->str() +
-               ")";
+    BinaryOpExpr(Expr* left, TokenType type, Expr* right)
+        : Expr(NodeKind::BINARY_OP), left(left), type(type), right(right) {}
+    void write(Printer& out, int depth) {
+        out.indent(depth).put('(');
+        left->write(out, 0);
+        out.put(' ').put(token_to_repr[type]).put(' ');
+        right->write(out, 0);
+        out.put(')');
     }
     void codegen(Chunk& code) {
         left->codegen(code);
@@ -153,25 +171,35 @@ struct BinaryOpExpr : Expr {
         }
     }
     virtual bool isBinaryOpExpr() { return true; }
-    ~BinaryOpExpr() {
-        DEL_EXPR(left);
-        DEL_EXPR(right);
-    }
 
     Expr* left;
     TokenType type;
     Expr* right;
 };
 
+// call fn on each item of a (possibly nested) comma list, or on expr alone;
+// an EmptyExpr is an empty list
+template <typename Fn>
+void forEachListItem(Expr* expr, Fn fn);
+
 struct CallExpr : Expr {
     CallExpr() = delete;
-    CallExpr(NameExpr* fn_name, Expr* args) : fn_name(fn_name), args(args) {}
-    std::string str(int depth) {
-        return tabs(depth) + BLUE + fn_name->name + RESET + "(" + args->str() + ")";
+    CallExpr(NameExpr* fn_name, Expr* args)
+        : Expr(NodeKind::CALL), fn_name(fn_name), args(args) {}
+    // args left to right, then OP_CALL fn_name argc
+    void codegen(Chunk& code) {
+        int argc = 0;
+        forEachListItem(args, [&](Expr* arg) {
+            arg->codegen(code);
+            argc++;
+        });
+        ConstIdx name_idx = code.regConstVal<std::string>(std::string(fn_name->name));
+        code.addOp(OP_CALL, {uint32_t(name_idx), uint32_t(argc)});
     }
-    ~CallExpr() {
-        DEL_EXPR(fn_name);
-        DEL_EXPR(args);
+    void write(Printer& out, int depth) {
+        out.indent(depth).put(BLUE).put(fn_name->name).put(RESET "(");
+        args->write(out, 0);
+        out.put(')');
     }
 
     NameExpr* fn_name;
@@ -180,18 +208,26 @@ struct CallExpr : Expr {
 
 struct ReturnExpr : Expr {
     ReturnExpr() = delete;
-    ReturnExpr(Expr* value) : value(value) {}
-    void codegen(Chunk& code) { code.addOp(OP_RET); }
-    std::string str(int depth) { return tabs(depth) + BRIGHTMAGENTA "ret " RESET + value->str(); }
-    ~ReturnExpr() { DEL_EXPR(value); }
+    ReturnExpr(Expr* value) : Expr(NodeKind::RETURN), value(value) {}
+    void codegen(Chunk& code) {
+        value->codegen(code);
+        code.addOp(OP_RET);
+    }
+    void write(Printer& out, int depth) {
+        out.indent(depth).put(BRIGHTMAGENTA "ret " RESET);
+        value->write(out, 0);
+    }
 
     Expr* value;
 };
 
 struct VarExpr : Expr {
     VarExpr() = delete;
-    VarExpr(Expr* value) : expr(value) {}
-    std::string str(int depth) { return tabs(depth) + BRIGHTMAGENTA "var " RESET + expr->str(); }
+    VarExpr(Expr* value) : Expr(NodeKind::VAR), expr(value) {}
+    void write(Printer& out, int depth) {
+        out.indent(depth).put(BRIGHTMAGENTA "var " RESET);
+        expr->write(out, 0);
+    }
 
     void codegen(Chunk& code) {
         if (expr->isBinaryOpExpr()){
@@ -201,47 +237,32 @@ struct VarExpr : Expr {
             // generate code for rhs expr
             assexpr->right->codegen(code); 
 
-            // this is assuming all definitions are global atm
-            code.addOp(OP_DEFINE_LOCAL); 
-
-            // put the var name in the constant table
+            // a local slot in a fn body, else a global one
             assert(assexpr->left->isNameExpr());
-            auto varname = assexpr->left->asName()->name;
-            ConstIdx idx = code.regConstVal<std::string>(varname);
-            //... and embed idx in instr stream
-            code.addOp(OpCode(idx));
+            code.addDefineVar(std::string(assexpr->left->asName()->name));
         } else if (expr->isNameExpr()){
 
             // no rhs expr, init to null
             code.addConstNull();
-
-            // this is assuming all definitions are global atm
-            code.addOp(OP_DEFINE_LOCAL);
-
-            // put the var name in the constant table
-            auto varname = expr->asName()->name;
-            ConstIdx idx = code.regConstVal<std::string>(varname);
-            //... and embed idx in instr stream
-            std::cout << "adding const idx " << OpCode(idx) << "\n";
-            code.addOp(OpCode(idx));
+            code.addDefineVar(std::string(expr->asName()->name));
         } else {
             assert(0 && "Ill-formed VarExpr");
         }
     }
-    ~VarExpr() { DEL_EXPR(expr); }
 
     Expr* expr;
 };
 
 struct SubscriptExpr : Expr {
     SubscriptExpr() = delete;
-    SubscriptExpr(Expr* array_name, Expr* index) : array_name(array_name), index(index) {}
-    std::string str(int depth) {
-        return tabs(depth) + array_name->str() + "[" + index->str() + "]";
-    }
-    ~SubscriptExpr() {
-        DEL_EXPR(index);
-        DEL_EXPR(array_name);
+    SubscriptExpr(Expr* array_name, Expr* index)
+        : Expr(NodeKind::SUBSCRIPT), array_name(array_name), index(index) {}
+    void write(Printer& out, int depth) {
+        out.indent(depth);
+        array_name->write(out, 0);
+        out.put('[');
+        index->write(out, 0);
+        out.put(']');
     }
 
     Expr* array_name;
@@ -250,64 +271,73 @@ struct SubscriptExpr : Expr {
 
 struct CommaListExpr : Expr {
     CommaListExpr() = delete;
-    CommaListExpr(std::vector<Expr*> exprs) : exprs(exprs) {}
+    CommaListExpr(ArenaArray<Expr*> exprs) : Expr(NodeKind::COMMA_LIST), exprs(exprs) {}
     void codegen(Chunk& code) { ERR("CommaExpr '%s' has no codegen.",str(0).c_str()); }
-    std::string str(int depth) {
-        std::string str = tabs(depth);
+    void write(Printer& out, int depth) {
+        out.indent(depth);
         for (auto expr = exprs.begin(); expr != exprs.end(); expr++) {
-            str += (*expr)->str();
+            (*expr)->write(out, 0);
             if (std::next(expr) != exprs.end())
-                str += ", ";
+                out.put(", ");
         }
-        return str;
-    }
-    ~CommaListExpr() {
-        for (auto expr : exprs)
-            DEL_EXPR(expr);
     }
 
-    std::vector<Expr*> exprs;
+    ArenaArray<Expr*> exprs;
 };
 
 struct BlockExpr : Expr {
     BlockExpr() = delete;
-    BlockExpr(std::vector<Expr*> stmts) : stmts(stmts) {}
-    std::string str(int depth) {
-        std::string str = tabs(depth) + "{";
-        std::string joinstr = "\n";
+    BlockExpr(ArenaArray<Expr*> stmts) : Expr(NodeKind::BLOCK), stmts(stmts) {}
+    // each statement leaves one value, which is popped; the block is null
+    void codegen(Chunk& code) {
+        for (auto stmt : stmts) {
+            stmt->codegen(code);
+            code.addOp(OP_POP);
+        }
+        code.addConstNull();
+    }
+    void write(Printer& out, int depth) {
+        out.indent(depth).put('{');
         if (not stmts.size()) {
-            return str + "}";
+            out.put('}');
+            return;
         }
         for (const auto expr : stmts) {
-            if (expr->str(depth) != "") {
-                str += joinstr + expr->str(depth + 1) + ";";
-            }
+            out.put('\n');
+            expr->write(out, depth + 1);
+            out.put(';');
         }
-        return str + joinstr + tabs(depth) + "}";
-    }
-    ~BlockExpr() {
-        for (auto expr : stmts)
-            DEL_EXPR(expr);
+        out.put('\n').indent(depth).put('}');
     }
 
-    std::vector<Expr*> stmts;
+    ArenaArray<Expr*> stmts;
+};
+
+// Function body that was skipped by the parser: source[begin:end] is its
+// text, braces included. It is parsed when the function is first called.
+struct LazyBlockExpr : Expr {
+    LazyBlockExpr() = delete;
+    LazyBlockExpr(std::string_view source, uint32_t begin, uint32_t end)
+        : Expr(NodeKind::LAZY_BLOCK), source(source), begin(begin), end(end) {}
+    void write(Printer& out, int depth) { out.indent(depth).put(body()); }
+    std::string_view body() const { return source.substr(begin, end - begin); }
+
+    std::string_view source;
+    uint32_t begin, end;
 };
 
 struct ForExpr : Expr {
     ForExpr() = delete;
     ForExpr(Expr* loop_var, Expr* range_expr, Expr* loop_body)
-        : loop_var(loop_var), range_expr(range_expr), loop_body(loop_body) {}
-    std::string str(int depth) {
-        std::string str = tabs(depth) + BRIGHTMAGENTA "for " RESET;
-        str += loop_var->str();
-        str += " : " + range_expr->str() + "\n";
-        str += loop_body->str(depth);
-        return str;
-    }
-    ~ForExpr() {
-        DEL_EXPR(loop_var);
-        DEL_EXPR(range_expr);
-        DEL_EXPR(loop_body);
+        : Expr(NodeKind::FOR), loop_var(loop_var), range_expr(range_expr),
+          loop_body(loop_body) {}
+    void write(Printer& out, int depth) {
+        out.indent(depth).put(BRIGHTMAGENTA "for " RESET);
+        loop_var->write(out, 0);
+        out.put(" : ");
+        range_expr->write(out, 0);
+        out.put('\n');
+        loop_body->write(out, depth);
     }
 
     Expr* loop_var;
@@ -318,18 +348,37 @@ struct ForExpr : Expr {
 struct FnDefExpr : Expr {
     FnDefExpr() = delete;
     FnDefExpr(NameExpr* fn_name, Expr* args, Expr* body)
-        : fn_name(fn_name), args(args), body(body) {}
-    std::string str(int depth) {
-        std::string str = tabs(depth) + BRIGHTMAGENTA "fn " RESET;
-        str += YELLOW + fn_name->str(0) + RESET;
-        str += "(" + args->str() + ")\n";
-        str += body->str(depth);
-        return str;
+        : Expr(NodeKind::FN_DEF), fn_name(fn_name), args(args), body(body) {}
+    void write(Printer& out, int depth) {
+        out.indent(depth).put(BRIGHTMAGENTA "fn " RESET YELLOW);
+        fn_name->write(out, 0);
+        out.put(RESET "(");
+        args->write(out, 0);
+        out.put(")\n");
+        body->write(out, depth);
     }
-    ~FnDefExpr() {
-        DEL_EXPR(fn_name);
-        DEL_EXPR(args);
-        DEL_EXPR(body);
+    // OP_DEFINE_FN binds the name when run; the statement's value is null
+    void codegen(Chunk& code) {
+        std::vector<std::string> params;
+        forEachListItem(args, [&](Expr* param) {
+            if (not param->isNameExpr())
+                ERR("codegen: parameter '%s' of fn '%.*s' is not a name\n",
+                    param->str(0).c_str(),
+                    int(fn_name->name.size()),
+                    fn_name->name.data());
+            params.emplace_back(param->asName()->name);
+        });
+        FnProto& fn = code.defineFn(std::string(fn_name->name), std::move(params));
+        if (body->kind == NodeKind::LAZY_BLOCK) {
+            auto lazy = static_cast<LazyBlockExpr*>(body);
+            fn.source = lazy->source;
+            fn.begin = lazy->begin;
+            fn.end = lazy->end;
+        } else {
+            body->codegen(fn.code);
+            fn.code.addOp(OP_RET);
+            fn.compiled = true;
+        }
     }
 
     NameExpr* fn_name;
@@ -340,20 +389,17 @@ struct FnDefExpr : Expr {
 struct IfExpr : Expr {
     IfExpr() = delete;
     IfExpr(bool hasElse, Expr* if_cond, Expr* if_body, Expr* else_body)
-        : has_else(hasElse), if_cond(if_cond), if_body(if_body), else_body(else_body) {}
-    std::string str(int depth) {
-        std::string str = tabs(depth) + BRIGHTMAGENTA "if " RESET;
-        str += if_cond->str() + "\n";
-        str += if_body->str(depth);
+        : Expr(NodeKind::IF), has_else(hasElse), if_cond(if_cond), if_body(if_body),
+          else_body(else_body) {}
+    void write(Printer& out, int depth) {
+        out.indent(depth).put(BRIGHTMAGENTA "if " RESET);
+        if_cond->write(out, 0);
+        out.put('\n');
+        if_body->write(out, depth);
         if (has_else) {
-            str += "\n" + tabs(depth) + "else\n" + else_body->str(depth);
+            out.put('\n').indent(depth).put("else\n");
+            else_body->write(out, depth);
         }
-        return str;
-    }
-    ~IfExpr() {
-        DEL_EXPR(if_cond);
-        DEL_EXPR(if_body);
-        DEL_EXPR(else_body);
     }
 
     bool has_else;
@@ -364,17 +410,33 @@ struct IfExpr : Expr {
 
 struct PrintExpr : Expr {
     PrintExpr() = delete;
-    PrintExpr(Expr* value) : value(value) {}
+    PrintExpr(Expr* value) : Expr(NodeKind::PRINT), value(value) {}
     void codegen(Chunk& code) { value->codegen(code); code.addOp(OP_PRINT); }
-    std::string str(int depth) { return tabs(depth) + YELLOW "print " RESET + value->str(); }
-    ~PrintExpr() { delete value; }
+    void write(Printer& out, int depth) {
+        out.indent(depth).put(YELLOW "print " RESET);
+        value->write(out, 0);
+    }
 
     Expr* value;
 };
 
 ////
 
-BinaryOpExpr* Expr::asBinOp() { return dynamic_cast<BinaryOpExpr*>(this); } 
-UnaryOpExpr* Expr::asUnaryOp() { return dynamic_cast<UnaryOpExpr*>(this);  } 
-NameExpr* Expr::asName() { return dynamic_cast<NameExpr*>(this); } 
-NumExpr* Expr::asNum() { return dynamic_cast<NumExpr*>(this); }
+BinaryOpExpr* Expr::asBinOp() {
+    return kind == NodeKind::BINARY_OP ? static_cast<BinaryOpExpr*>(this) : nullptr;
+}
+UnaryOpExpr* Expr::asUnaryOp() {
+    return kind == NodeKind::UNARY_OP ? static_cast<UnaryOpExpr*>(this) : nullptr;
+}
+NameExpr* Expr::asName() { return kind == NodeKind::NAME ? static_cast<NameExpr*>(this) : nullptr; }
+NumExpr* Expr::asNum() { return kind == NodeKind::NUM ? static_cast<NumExpr*>(this) : nullptr; }
+
+template <typename Fn>
+void forEachListItem(Expr* expr, Fn fn) {
+    if (expr->kind == NodeKind::COMMA_LIST) {
+        for (auto item : static_cast<CommaListExpr*>(expr)->exprs)
+            forEachListItem(item, fn);
+    } else if (expr->kind != NodeKind::EMPTY) {
+        fn(expr);
+    }
+}
@@ -0,0 +1,563 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "color.hpp"
+#include "expr.hpp"
+#include "printer.hpp"
+#include "scan.hpp"
+#include "util.hpp"
+#include "vm.hpp"
+
+// Flattened AST: every node is a 16 byte FlatNode in one array, children are
+// referred to by 32-bit index, and printing/codegen walk it with a switch on
+// the node kind instead of virtual calls. Children always come before their
+// parent, so the arrays can be written out and read back as they are.
+//
+// Fields per kind:
+//   NAME, STRING       a, b  = offset, length of the text in chars
+//   NUM                a:b   = bits of the double
+//   BOOL               op    = value
+//   UNARY_OP           op    = operator, a = operand
+//   BINARY_OP          op    = operator, a, b = operands
+//   COMMA_LIST, BLOCK  a, b  = first, count of child indices in lists
+//   CALL, FN_DEF       a = name, b = args, c = body (FN_DEF only)
+//   LAZY_BLOCK         a, b  = offset, length of the body text, which is
+//                      followed by a '\0' so it can be handed to a Scanner
+//   IF                 op    = has else, a = cond, b = body, c = else body
+//   FOR                a = loop var, b = range, c = body
+//   RETURN, VAR, PRINT a = value
+//   SUBSCRIPT          a = array, b = index
+struct FlatNode {
+    NodeKind kind = NodeKind::EMPTY;
+    uint8_t op = 0;
+    uint32_t a = 0, b = 0, c = 0;
+};
+static_assert(sizeof(FlatNode) == 16);
+
+struct FlatAst {
+    typedef uint32_t NodeIdx;
+
+    // flatten a statement and add it to the roots
+    void addStatement(Expr* stmt) { roots.push_back(flatten(stmt)); }
+
+    NodeIdx flatten(Expr* expr) {
+        FlatNode node;
+        node.kind = expr->kind;
+        switch (expr->kind) {
+        case NodeKind::EMPTY:
+            break;
+        case NodeKind::NAME:
+            setText(node, static_cast<NameExpr*>(expr)->name);
+            break;
+        case NodeKind::STRING:
+            setText(node, static_cast<StringExpr*>(expr)->string);
+            break;
+        case NodeKind::NUM:
+            setNum(node, static_cast<NumExpr*>(expr)->num);
+            break;
+        case NodeKind::BOOL:
+            node.op = static_cast<BoolExpr*>(expr)->val;
+            break;
+        case NodeKind::UNARY_OP: {
+            auto unop = static_cast<UnaryOpExpr*>(expr);
+            node.op = unop->type;
+            node.a = flatten(unop->right);
+            break;
+        }
+        case NodeKind::BINARY_OP: {
+            auto binop = static_cast<BinaryOpExpr*>(expr);
+            node.op = binop->type;
+            node.a = flatten(binop->left);
+            node.b = flatten(binop->right);
+            break;
+        }
+        case NodeKind::CALL: {
+            auto call = static_cast<CallExpr*>(expr);
+            node.a = flatten(call->fn_name);
+            node.b = flatten(call->args);
+            break;
+        }
+        case NodeKind::RETURN:
+            node.a = flatten(static_cast<ReturnExpr*>(expr)->value);
+            break;
+        case NodeKind::VAR:
+            node.a = flatten(static_cast<VarExpr*>(expr)->expr);
+            break;
+        case NodeKind::PRINT:
+            node.a = flatten(static_cast<PrintExpr*>(expr)->value);
+            break;
+        case NodeKind::SUBSCRIPT: {
+            auto subscript = static_cast<SubscriptExpr*>(expr);
+            node.a = flatten(subscript->array_name);
+            node.b = flatten(subscript->index);
+            break;
+        }
+        case NodeKind::COMMA_LIST:
+            setList(node, static_cast<CommaListExpr*>(expr)->exprs);
+            break;
+        case NodeKind::BLOCK:
+            setList(node, static_cast<BlockExpr*>(expr)->stmts);
+            break;
+        case NodeKind::FOR: {
+            auto loop = static_cast<ForExpr*>(expr);
+            node.a = flatten(loop->loop_var);
+            node.b = flatten(loop->range_expr);
+            node.c = flatten(loop->loop_body);
+            break;
+        }
+        case NodeKind::FN_DEF: {
+            auto fn = static_cast<FnDefExpr*>(expr);
+            node.a = flatten(fn->fn_name);
+            node.b = flatten(fn->args);
+            node.c = flatten(fn->body);
+            break;
+        }
+        case NodeKind::LAZY_BLOCK:
+            setText(node, static_cast<LazyBlockExpr*>(expr)->body());
+            chars.push_back('\0');
+            break;
+        case NodeKind::IF: {
+            auto ifexpr = static_cast<IfExpr*>(expr);
+            node.op = ifexpr->has_else;
+            node.a = flatten(ifexpr->if_cond);
+            node.b = flatten(ifexpr->if_body);
+            node.c = flatten(ifexpr->else_body);
+            break;
+        }
+        default:
+            ERR("flatten: unknown node kind %d\n", int(expr->kind));
+        }
+        nodes.push_back(node);
+        return nodes.size() - 1;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // node payloads
+
+    void setText(FlatNode& node, std::string_view text) {
+        node.a = chars.size();
+        node.b = text.size();
+        chars.insert(chars.end(), text.begin(), text.end());
+    }
+    std::string_view text(const FlatNode& node) const {
+        return std::string_view(chars.data() + node.a, node.b);
+    }
+    void setNum(FlatNode& node, double num) {
+        uint64_t bits;
+        memcpy(&bits, &num, sizeof(bits));
+        node.a = bits >> 32;
+        node.b = uint32_t(bits);
+    }
+    double num(const FlatNode& node) const {
+        uint64_t bits = (uint64_t(node.a) << 32) | node.b;
+        double num;
+        memcpy(&num, &bits, sizeof(num));
+        return num;
+    }
+    void setList(FlatNode& node, ArenaArray<Expr*> items) {
+        std::vector<NodeIdx> children;
+        for (auto item : items)
+            children.push_back(flatten(item));
+        node.a = lists.size();
+        node.b = children.size();
+        lists.insert(lists.end(), children.begin(), children.end());
+    }
+    const NodeIdx* listBegin(const FlatNode& node) const { return lists.data() + node.a; }
+    const NodeIdx* listEnd(const FlatNode& node) const { return lists.data() + node.a + node.b; }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // printing, same output as Expr::write()
+
+    void print(NodeIdx idx, bool semicolon = false) const {
+        Printer out;
+        write(out, idx);
+        out.put(semicolon ? ";\n\n" : "\n\n").flush();
+    }
+
+    std::string str(NodeIdx idx, int depth = 0) const {
+        Printer out;
+        write(out, idx, depth);
+        return std::move(out.buf);
+    }
+
+    void write(Printer& out, NodeIdx idx, int depth = 0) const {
+        const FlatNode& node = nodes[idx];
+        switch (node.kind) {
+        case NodeKind::EMPTY:
+            out.indent(depth).put("(EMPTY)");
+            break;
+        case NodeKind::NAME:
+            out.put(text(node));
+            break;
+        case NodeKind::STRING:
+            out.put(BRIGHTBLUE "\"").put(text(node)).put("\"" RESET);
+            break;
+        case NodeKind::NUM:
+            out.indent(depth).num(num(node));
+            break;
+        case NodeKind::BOOL:
+            out.indent(depth).put(node.op ? "True" : "False");
+            break;
+        case NodeKind::UNARY_OP:
+            out.put('(').put(token_to_repr[node.op]);
+            write(out, node.a);
+            out.put(')');
+            break;
+        case NodeKind::BINARY_OP:
+            out.indent(depth).put('(');
+            write(out, node.a);
+            out.put(' ').put(token_to_repr[node.op]).put(' ');
+            write(out, node.b);
+            out.put(')');
+            break;
+        case NodeKind::CALL:
+            out.indent(depth).put(BLUE);
+            write(out, node.a);
+            out.put(RESET "(");
+            write(out, node.b);
+            out.put(')');
+            break;
+        case NodeKind::RETURN:
+            out.indent(depth).put(BRIGHTMAGENTA "ret " RESET);
+            write(out, node.a);
+            break;
+        case NodeKind::VAR:
+            out.indent(depth).put(BRIGHTMAGENTA "var " RESET);
+            write(out, node.a);
+            break;
+        case NodeKind::PRINT:
+            out.indent(depth).put(YELLOW "print " RESET);
+            write(out, node.a);
+            break;
+        case NodeKind::SUBSCRIPT:
+            out.indent(depth);
+            write(out, node.a);
+            out.put('[');
+            write(out, node.b);
+            out.put(']');
+            break;
+        case NodeKind::COMMA_LIST:
+            out.indent(depth);
+            for (auto child = listBegin(node); child != listEnd(node); child++) {
+                write(out, *child);
+                if (child + 1 != listEnd(node))
+                    out.put(", ");
+            }
+            break;
+        case NodeKind::BLOCK:
+            out.indent(depth).put('{');
+            if (not node.b) {
+                out.put('}');
+                break;
+            }
+            for (auto child = listBegin(node); child != listEnd(node); child++) {
+                out.put('\n');
+                write(out, *child, depth + 1);
+                out.put(';');
+            }
+            out.put('\n').indent(depth).put('}');
+            break;
+        case NodeKind::FOR:
+            out.indent(depth).put(BRIGHTMAGENTA "for " RESET);
+            write(out, node.a);
+            out.put(" : ");
+            write(out, node.b);
+            out.put('\n');
+            write(out, node.c, depth);
+            break;
+        case NodeKind::FN_DEF:
+            out.indent(depth).put(BRIGHTMAGENTA "fn " RESET YELLOW);
+            write(out, node.a);
+            out.put(RESET "(");
+            write(out, node.b);
+            out.put(")\n");
+            write(out, node.c, depth);
+            break;
+        case NodeKind::IF:
+            out.indent(depth).put(BRIGHTMAGENTA "if " RESET);
+            write(out, node.a);
+            out.put('\n');
+            write(out, node.b, depth);
+            if (node.op) {
+                out.put('\n').indent(depth).put("else\n");
+                write(out, node.c, depth);
+            }
+            break;
+        case NodeKind::LAZY_BLOCK:
+            out.indent(depth).put(text(node));
+            break;
+        default:
+            out.put("(UNIMPLEMENTED)");
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // codegen, same bytecode as Expr::codegen()
+
+    void codegen(NodeIdx idx, Chunk& code) const {
+        const FlatNode& node = nodes[idx];
+        switch (node.kind) {
+        case NodeKind::NAME:
+            code.addGetVar(std::string(text(node)));
+            break;
+        case NodeKind::STRING:
+            code.addConstStr(std::string(text(node)));
+            break;
+        case NodeKind::NUM:
+            code.addConstNum(num(node));
+            break;
+        case NodeKind::BOOL:
+            code.addConstBool(node.op);
+            break;
+        case NodeKind::UNARY_OP:
+            codegen(node.a, code);
+            if (token_to_unaryop.count(TokenType(node.op))) {
+                code.addOp(token_to_unaryop.at(TokenType(node.op)));
+            } else {
+                ERR("codegen: tokentype '%s' in expr '%s' not implemented as unary op",
+                    token_to_typestr[node.op],
+                    str(idx).c_str());
+            }
+            break;
+        case NodeKind::BINARY_OP:
+            codegen(node.a, code);
+            codegen(node.b, code);
+            if (token_to_binop.count(TokenType(node.op))) {
+                code.addOp(token_to_binop.at(TokenType(node.op)));
+            } else {
+                ERR("codegen: tokentype '%s' in expr '%s' not implemented as binary op",
+                    token_to_typestr[node.op],
+                    str(idx).c_str());
+            }
+            break;
+        case NodeKind::RETURN:
+            codegen(node.a, code);
+            code.addOp(OP_RET);
+            break;
+        case NodeKind::CALL: {
+            int argc = 0;
+            forEachListItem(node.b, [&](NodeIdx arg) {
+                codegen(arg, code);
+                argc++;
+            });
+            ConstIdx name_idx = code.regConstVal<std::string>(std::string(text(nodes[node.a])));
+            code.addOp(OP_CALL, {uint32_t(name_idx), uint32_t(argc)});
+            break;
+        }
+        case NodeKind::BLOCK:
+            for (auto child = listBegin(node); child != listEnd(node); child++) {
+                codegen(*child, code);
+                code.addOp(OP_POP);
+            }
+            code.addConstNull();
+            break;
+        case NodeKind::FN_DEF: {
+            std::string fn_name(text(nodes[node.a]));
+            std::vector<std::string> params;
+            forEachListItem(node.b, [&](NodeIdx param) {
+                if (nodes[param].kind != NodeKind::NAME)
+                    ERR("codegen: parameter '%s' of fn '%s' is not a name\n",
+                        str(param).c_str(),
+                        fn_name.c_str());
+                params.emplace_back(text(nodes[param]));
+            });
+            FnProto& fn = code.defineFn(fn_name, std::move(params));
+            if (nodes[node.c].kind == NodeKind::LAZY_BLOCK) {
+                fn.source = text(nodes[node.c]);
+                fn.begin = 0;
+                fn.end = fn.source.size();
+            } else {
+                codegen(node.c, fn.code);
+                fn.code.addOp(OP_RET);
+                fn.compiled = true;
+            }
+            break;
+        }
+        case NodeKind::PRINT:
+            codegen(node.a, code);
+            code.addOp(OP_PRINT);
+            break;
+        case NodeKind::VAR: {
+            const FlatNode& def = nodes[node.a];
+            if (def.kind == NodeKind::BINARY_OP) {
+                assert(def.op == EQUALS);
+                codegen(def.b, code);
+                assert(nodes[def.a].kind == NodeKind::NAME);
+                code.addDefineVar(std::string(text(nodes[def.a])));
+            } else if (def.kind == NodeKind::NAME) {
+                // no rhs expr, init to null
+                code.addConstNull();
+                code.addDefineVar(std::string(text(def)));
+            } else {
+                assert(0 && "Ill-formed VarExpr");
+            }
+            break;
+        }
+        case NodeKind::COMMA_LIST:
+            ERR("CommaExpr '%s' has no codegen.", str(idx).c_str());
+        default:
+            ERR("codegen for expr \n'%s' is UNIMPLEMENTED.\n", str(idx).c_str());
+        }
+    }
+
+    // as forEachListItem() in expr.hpp
+    template <typename Fn>
+    void forEachListItem(NodeIdx idx, Fn fn) const {
+        const FlatNode& node = nodes[idx];
+        if (node.kind == NodeKind::COMMA_LIST) {
+            for (auto child = listBegin(node); child != listEnd(node); child++)
+                forEachListItem(*child, fn);
+        } else if (node.kind != NodeKind::EMPTY) {
+            fn(idx);
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // serialization: a header of array sizes followed by the arrays themselves
+
+    static constexpr uint32_t magic = 0x54414c46; // "FLAT"
+
+    std::string serialize() const {
+        std::string out;
+        uint32_t header[] = {magic,
+                             uint32_t(nodes.size()),
+                             uint32_t(chars.size()),
+                             uint32_t(lists.size()),
+                             uint32_t(roots.size())};
+        out.append((const char*)header, sizeof(header));
+        out.append((const char*)nodes.data(), nodes.size() * sizeof(FlatNode));
+        out.append(chars.data(), chars.size());
+        out.append((const char*)lists.data(), lists.size() * sizeof(NodeIdx));
+        out.append((const char*)roots.data(), roots.size() * sizeof(NodeIdx));
+        return out;
+    }
+
+    // returns false (leaving this empty) if data is not a well-formed FlatAst
+    bool deserialize(std::string_view data) {
+        *this = FlatAst();
+        uint32_t header[5];
+        if (data.size() < sizeof(header))
+            return false;
+        memcpy(header, data.data(), sizeof(header));
+        size_t sz = sizeof(header) + size_t(header[1]) * sizeof(FlatNode) + header[2] +
+                    (size_t(header[3]) + header[4]) * sizeof(NodeIdx);
+        if (header[0] != magic or data.size() != sz)
+            return false;
+
+        const char* p = data.data() + sizeof(header);
+        auto read = [&p](auto& vec, size_t n) {
+            vec.resize(n);
+            memcpy(vec.data(), p, n * sizeof(vec[0]));
+            p += n * sizeof(vec[0]);
+        };
+        read(nodes, header[1]);
+        read(chars, header[2]);
+        read(lists, header[3]);
+        read(roots, header[4]);
+        if (not valid()) {
+            *this = FlatAst();
+            return false;
+        }
+        return true;
+    }
+
+    // children come before parents, all payloads are in bounds and names are
+    // where codegen reads them as text
+    bool valid() const {
+        for (NodeIdx i = 0; i < nodes.size(); i++) {
+            const FlatNode& node = nodes[i];
+            switch (node.kind) {
+            case NodeKind::EMPTY:
+            case NodeKind::NUM:
+            case NodeKind::BOOL:
+                break;
+            case NodeKind::NAME:
+            case NodeKind::STRING:
+                if (size_t(node.a) + node.b > chars.size())
+                    return false;
+                break;
+            case NodeKind::LAZY_BLOCK:
+                if (size_t(node.a) + node.b >= chars.size() or chars[node.a + node.b] != '\0')
+                    return false;
+                break;
+            case NodeKind::COMMA_LIST:
+            case NodeKind::BLOCK:
+                if (size_t(node.a) + node.b > lists.size())
+                    return false;
+                for (auto child = listBegin(node); child != listEnd(node); child++)
+                    if (*child >= i)
+                        return false;
+                break;
+            case NodeKind::FOR:
+            case NodeKind::FN_DEF:
+            case NodeKind::IF:
+                if (node.c >= i)
+                    return false;
+                // fall through
+            case NodeKind::BINARY_OP:
+            case NodeKind::CALL:
+            case NodeKind::SUBSCRIPT:
+                if (node.b >= i)
+                    return false;
+                // fall through
+            case NodeKind::UNARY_OP:
+            case NodeKind::RETURN:
+            case NodeKind::VAR:
+            case NodeKind::PRINT:
+                if (node.a >= i)
+                    return false;
+                break;
+            default:
+                return false;
+            }
+            if ((node.kind == NodeKind::UNARY_OP or node.kind == NodeKind::BINARY_OP) and
+                node.op >= NUM_TOKEN_TYPES)
+                return false;
+            if (not validNames(node))
+                return false;
+        }
+        for (auto root : roots)
+            if (root >= nodes.size())
+                return false;
+        return true;
+    }
+
+    // the children of node that must be NAMEs are, its children being valid
+    bool validNames(const FlatNode& node) const {
+        auto isName = [this](NodeIdx idx) { return nodes[idx].kind == NodeKind::NAME; };
+        switch (node.kind) {
+        case NodeKind::CALL:
+        case NodeKind::FOR:
+            return isName(node.a);
+        case NodeKind::FN_DEF: {
+            bool names = isName(node.a);
+            forEachListItem(node.b, [&](NodeIdx param) { names &= isName(param); });
+            return names;
+        }
+        case NodeKind::VAR: {
+            // var name [= expr]
+            const FlatNode& def = nodes[node.a];
+            return def.kind == NodeKind::NAME or
+                   (def.kind == NodeKind::BINARY_OP and def.op == EQUALS and isName(def.a));
+        }
+        default:
+            return true;
+        }
+    }
+
+    size_t bytesUsed() const {
+        return nodes.capacity() * sizeof(FlatNode) + chars.capacity() +
+               (lists.capacity() + roots.capacity()) * sizeof(NodeIdx);
+    }
+
+    std::vector<FlatNode> nodes;
+    std::vector<char> chars;
+    std::vector<NodeIdx> lists;
+    std::vector<NodeIdx> roots; // top-level statements
+};
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <cmath>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "arena.hpp"
+#include "expr.hpp"
+#include "scan.hpp"
+#include "vm.hpp"
+
+// Constant folding over the AST, between parsing and codegen.
+//
+// Unary and binary ops on NumExpr/BoolExpr operands are evaluated with the
+// VM's own arithmetic (evalUnaryOp/evalBinaryOp) and replaced by their value.
+// Identities are only applied where they hold for every value the VM could
+// see: x*1, x/1, x-0 and x+(-0) for numeric x, !!b for boolean b, and - -x.
+// x+0 is left alone, as it turns -0 into 0.
+//
+// foldProgram() also replaces top-level reads of a var that is defined once
+// at top level, to a literal, by the literal. Top-level statements run in
+// order, so such a read comes after the definition. A var that is also
+// assigned anywhere, fn bodies included, is not propagated. Fn bodies are
+// folded but not propagated into: they may run before the var is defined, or
+// shadow it.
+struct Folder {
+    Folder(Arena& arena) : arena(&arena) {}
+
+    // fold a whole program, propagating var bindings between statements
+    void foldProgram(std::vector<Expr*>& stmts) {
+        std::unordered_map<std::string_view, int> ndefs;
+        for (auto stmt : stmts)
+            countDefs(stmt, ndefs);
+        propagate = true;
+        for (auto& stmt : stmts) {
+            stmt = fold(stmt);
+            if (auto* var = literalVar(stmt); var and ndefs[var->left->asName()->name] == 1)
+                bindings[var->left->asName()->name] = var->right;
+        }
+        propagate = false;
+    }
+
+    // fold one expression, returning what replaces it
+    Expr* fold(Expr* expr) {
+        switch (expr->kind) {
+        case NodeKind::NAME: {
+            if (not propagate)
+                return expr;
+            auto it = bindings.find(expr->asName()->name);
+            if (it == bindings.end())
+                return expr;
+            nfolded++;
+            return copyLiteral(it->second);
+        }
+        case NodeKind::UNARY_OP: return foldUnaryOp(expr->asUnaryOp());
+        case NodeKind::BINARY_OP: return foldBinaryOp(expr->asBinOp());
+        case NodeKind::CALL: {
+            auto call = static_cast<CallExpr*>(expr);
+            call->args = fold(call->args);
+            return expr;
+        }
+        case NodeKind::COMMA_LIST: {
+            for (auto& item : static_cast<CommaListExpr*>(expr)->exprs)
+                item = fold(item);
+            return expr;
+        }
+        case NodeKind::RETURN: {
+            auto ret = static_cast<ReturnExpr*>(expr);
+            ret->value = fold(ret->value);
+            return expr;
+        }
+        case NodeKind::PRINT: {
+            auto print = static_cast<PrintExpr*>(expr);
+            print->value = fold(print->value);
+            return expr;
+        }
+        case NodeKind::VAR: {
+            auto var = static_cast<VarExpr*>(expr);
+            if (auto* def = var->expr->asBinOp())
+                def->right = fold(def->right);
+            return expr;
+        }
+        case NodeKind::BLOCK: {
+            for (auto& stmt : static_cast<BlockExpr*>(expr)->stmts)
+                stmt = fold(stmt);
+            return expr;
+        }
+        case NodeKind::FN_DEF: {
+            auto fn = static_cast<FnDefExpr*>(expr);
+            bool outer = propagate;
+            propagate = false;
+            fn->body = fold(fn->body);
+            propagate = outer;
+            return expr;
+        }
+        default:
+            // no codegen, or nothing to fold
+            return expr;
+        }
+    }
+
+    // number of nodes replaced
+    size_t nfolded = 0;
+
+  private:
+    Expr* foldUnaryOp(UnaryOpExpr* expr) {
+        expr->right = fold(expr->right);
+        Value operand;
+        if (token_to_unaryop.count(expr->type) and literalValue(expr->right, operand)) {
+            return folded(evalUnaryOp(token_to_unaryop.at(expr->type), operand));
+        }
+        // - -x is x for every value; !!b only for bools, !!2 is 1
+        auto inner = expr->right->asUnaryOp();
+        if (inner and inner->type == expr->type) {
+            if (expr->type == MINUS or (expr->type == BANG and isBoolean(inner->right))) {
+                nfolded++;
+                return inner->right;
+            }
+        }
+        return expr;
+    }
+
+    Expr* foldBinaryOp(BinaryOpExpr* expr) {
+        if (not token_to_binop.count(expr->type)) {
+            // EQUALS of a var; left is the name defined
+            expr->right = fold(expr->right);
+            return expr;
+        }
+        expr->left = fold(expr->left);
+        expr->right = fold(expr->right);
+        Value A, B, result;
+        if (literalValue(expr->left, A) and literalValue(expr->right, B) and
+            evalBinaryOp(token_to_binop.at(expr->type), A, B, result))
+            return folded(result);
+
+        Expr* left = expr->left;
+        Expr* right = expr->right;
+        switch (expr->type) {
+        case MULT:
+            if (isNum(right, 1) and isNumeric(left))
+                return identity(left);
+            if (isNum(left, 1) and isNumeric(right))
+                return identity(right);
+            break;
+        case DIV:
+            if (isNum(right, 1) and isNumeric(left))
+                return identity(left);
+            break;
+        case MINUS:
+            if (isNum(right, 0) and not std::signbit(right->asNum()->num) and isNumeric(left))
+                return identity(left);
+            break;
+        case PLUS:
+            if (isNum(right, 0) and std::signbit(right->asNum()->num) and isNumeric(left))
+                return identity(left);
+            if (isNum(left, 0) and std::signbit(left->asNum()->num) and isNumeric(right))
+                return identity(right);
+            break;
+        default:
+            break;
+        }
+        return expr;
+    }
+
+    // value of a NumExpr or BoolExpr
+    static bool literalValue(Expr* expr, Value& val) {
+        if (expr->kind == NodeKind::NUM)
+            val = Value(static_cast<NumExpr*>(expr)->num);
+        else if (expr->kind == NodeKind::BOOL)
+            val = Value(static_cast<BoolExpr*>(expr)->val);
+        else
+            return false;
+        return true;
+    }
+    Expr* folded(const Value& val) {
+        nfolded++;
+        if (val.isBool())
+            return arena->make<BoolExpr>(val.boolean);
+        return arena->make<NumExpr>(val.asNum());
+    }
+    Expr* identity(Expr* operand) {
+        nfolded++;
+        return operand;
+    }
+
+    static bool isNum(Expr* expr, double num) {
+        return expr->kind == NodeKind::NUM and expr->asNum()->num == num;
+    }
+    // always a num when run: arithmetic results, whatever their operands
+    static bool isNumeric(Expr* expr) {
+        if (auto bin = expr->asBinOp())
+            return bin->type == PLUS or bin->type == MINUS or bin->type == MULT or bin->type == DIV;
+        if (auto unary = expr->asUnaryOp())
+            return isNumeric(unary->right);
+        return expr->kind == NodeKind::NUM;
+    }
+    // always a bool when run
+    static bool isBoolean(Expr* expr) {
+        if (auto bin = expr->asBinOp())
+            return bin->type == OR or bin->type == AND or bin->type == CMP;
+        if (auto unary = expr->asUnaryOp())
+            return isBoolean(unary->right);
+        return expr->kind == NodeKind::BOOL;
+    }
+
+    // the definition of `var name = literal`, if that is what stmt is
+    static BinaryOpExpr* literalVar(Expr* stmt) {
+        if (stmt->kind != NodeKind::VAR)
+            return nullptr;
+        auto def = static_cast<VarExpr*>(stmt)->expr->asBinOp();
+        if (not def or not def->left->isNameExpr())
+            return nullptr;
+        auto kind = def->right->kind;
+        return kind == NodeKind::NUM or kind == NodeKind::BOOL or kind == NodeKind::STRING ? def
+                                                                                            : nullptr;
+    }
+    Expr* copyLiteral(Expr* literal) {
+        switch (literal->kind) {
+        case NodeKind::NUM: return arena->make<NumExpr>(literal->asNum()->num);
+        case NodeKind::BOOL: return arena->make<BoolExpr>(static_cast<BoolExpr*>(literal)->val);
+        default: return arena->make<StringExpr>(static_cast<StringExpr*>(literal)->string);
+        }
+    }
+
+    // count the definitions of each name that land in the top-level varframe:
+    // vars outside fn bodies, and `name = expr` assignments anywhere, as a fn
+    // body may assign a top-level var when it runs
+    static void countDefs(Expr* expr, std::unordered_map<std::string_view, int>& ndefs, bool in_fn = false) {
+        auto count = [&ndefs, in_fn](Expr* child) { countDefs(child, ndefs, in_fn); };
+        switch (expr->kind) {
+        case NodeKind::VAR: {
+            Expr* def = static_cast<VarExpr*>(expr)->expr;
+            if (auto bin = def->asBinOp()) {
+                if (bin->left->isNameExpr() and not in_fn)
+                    ndefs[bin->left->asName()->name]++;
+                count(bin->right);
+            } else if (def->isNameExpr() and not in_fn) {
+                ndefs[def->asName()->name]++;
+            }
+            break;
+        }
+        case NodeKind::UNARY_OP: count(expr->asUnaryOp()->right); break;
+        case NodeKind::BINARY_OP: {
+            auto bin = expr->asBinOp();
+            if (bin->type == EQUALS and bin->left->isNameExpr())
+                ndefs[bin->left->asName()->name]++;
+            else
+                count(bin->left);
+            count(bin->right);
+            break;
+        }
+        case NodeKind::CALL: count(static_cast<CallExpr*>(expr)->args); break;
+        case NodeKind::RETURN: count(static_cast<ReturnExpr*>(expr)->value); break;
+        case NodeKind::PRINT: count(static_cast<PrintExpr*>(expr)->value); break;
+        case NodeKind::SUBSCRIPT:
+            count(static_cast<SubscriptExpr*>(expr)->array_name);
+            count(static_cast<SubscriptExpr*>(expr)->index);
+            break;
+        case NodeKind::COMMA_LIST:
+            for (auto item : static_cast<CommaListExpr*>(expr)->exprs)
+                count(item);
+            break;
+        case NodeKind::BLOCK:
+            for (auto stmt : static_cast<BlockExpr*>(expr)->stmts)
+                count(stmt);
+            break;
+        case NodeKind::FOR: {
+            auto loop = static_cast<ForExpr*>(expr);
+            count(loop->loop_var);
+            count(loop->range_expr);
+            count(loop->loop_body);
+            break;
+        }
+        case NodeKind::IF: {
+            auto branch = static_cast<IfExpr*>(expr);
+            count(branch->if_cond);
+            count(branch->if_body);
+            if (branch->else_body)
+                count(branch->else_body);
+            break;
+        }
+        case NodeKind::FN_DEF: {
+            // vars in the body define in its own varframe
+            Expr* body = static_cast<FnDefExpr*>(expr)->body;
+            if (body->kind == NodeKind::LAZY_BLOCK)
+                countLazyAssigns(static_cast<LazyBlockExpr*>(body), ndefs);
+            else
+                countDefs(body, ndefs, true);
+            break;
+        }
+        default: break;
+        }
+    }
+    // count the `name =` in an unparsed fn body, other than `var name =`
+    static void countLazyAssigns(LazyBlockExpr* lazy, std::unordered_map<std::string_view, int>& ndefs) {
+        Scanner scanner(lazy->source.data(), lazy->source.size(), lazy->begin, lazy->end);
+        TokenType before = NONE, prev = NONE;
+        std::string_view name;
+        for (Token tok = scanner.next(); tok.type != NONE; tok = scanner.next()) {
+            if (tok.type == EQUALS and prev == ID and before != VAR)
+                ndefs[name]++;
+            before = prev, prev = tok.type, name = tok.str;
+        }
+    }
+
+    Arena* arena;
+    bool propagate = false;
+    // top-level vars defined once, to a literal, by a statement already folded
+    std::unordered_map<std::string_view, Expr*> bindings;
+};
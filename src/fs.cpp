@@ -1,4 +1,9 @@
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string>
@@ -10,53 +15,168 @@
 bool file_exists(std::string& filepath) { return access(filepath.c_str(), F_OK) == 0; }
 bool file_exists(const char* filepath) { return access(filepath, F_OK) == 0; }
 
-size_t get_filesize(const char* filepath) {
-    FILE* fp = fopen(filepath, "r");
-    struct stat stat;
-    fstat(fileno(fp), &stat);
-    fclose(fp);
-    return stat.st_size;
-}
-
 std::string get_abspath(const char* relpath) {
     char actualpath[1000];
     realpath(relpath, actualpath);
     return std::string(actualpath);
 }
 
-[[nodiscard]] ErrCode slurpFile(char* filepath, char* contents) {
+SourceFile::~SourceFile() {
+    if (map)
+        munmap(map, map_sz);
+}
+
+// read all of fd into file.owned; used for files that can't be mapped
+static ErrCode readAll(int fd, SourceFile& file) {
+    char chunk[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+        file.owned.append(chunk, n);
+        if (file.owned.size() > max_source_size) {
+            fprintf(stderr, "Input is over the limit of %zu bytes\n", max_source_size);
+            return FILE_ERR;
+        }
+    }
+    if (n < 0)
+        return FILE_ERR;
+    file.buf = file.owned.c_str();
+    file.sz = file.owned.size();
+    return SUCCESS;
+}
+
+[[nodiscard]] ErrCode mapFile(const char* filepath, SourceFile& file) {
 
     if (!file_exists(filepath)) {
         printf("Input file '%s' does not exist\n", filepath);
         return FILE_ERR;
     }
 
-    // printf("compiling file '%s'\n", get_abspath(filepath).c_str());
+    int fd = open(filepath, O_RDONLY);
+    struct stat st;
+    if (fd < 0 or fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error opening file '%s'\n", filepath);
+        if (fd >= 0)
+            close(fd);
+        return FILE_ERR;
+    }
 
-    // read file into a buffer
-    size_t filesize = get_filesize(filepath);
-    assert(filesize < MAX_FILE_SIZE);
-    FILE* fp = fopen(filepath, "r");
-    fread(contents, sizeof(char), filesize, fp);
+    if (not S_ISREG(st.st_mode)) {
+        ErrCode stat = readAll(fd, file);
+        close(fd);
+        if (stat != SUCCESS)
+            fprintf(stderr, "Error reading file into memory '%s'\n", filepath);
+        return stat;
+    }
 
-    // detect errors if any and close fp
-    if (ferror(fp) != 0) {
-        fprintf(stderr, "Error reading file into memory '%s'\n", filepath);
+    size_t filesize = st.st_size;
+    if (filesize > max_source_size) {
+        fprintf(stderr, "Input file '%s' is %zu bytes, over the limit of %zu\n", filepath, filesize, max_source_size);
+        close(fd);
         return FILE_ERR;
     }
+    if (filesize == 0) {
+        close(fd);
+        return SUCCESS;
+    }
+
+    // Bytes past EOF in the last mapped page read as zero, which gives the
+    // scanner its terminator for free. If the file ends exactly on a page
+    // boundary there is no such byte, so map it over a reserved anonymous
+    // region one page larger instead.
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE; // prefault now rather than page by page while scanning
+#endif
+    void* map = MAP_FAILED;
+    size_t map_sz = filesize;
+    if (filesize % pagesize == 0) {
+        map_sz = filesize + pagesize;
+        void* reserved = mmap(nullptr, map_sz, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (reserved != MAP_FAILED) {
+            map = mmap(reserved, filesize, PROT_READ, flags | MAP_FIXED, fd, 0);
+            if (map == MAP_FAILED)
+                munmap(reserved, map_sz);
+        }
+    } else {
+        map = mmap(nullptr, filesize, PROT_READ, flags, fd, 0);
+    }
 
-    // make sure null terminated
-    contents[filesize] = '\0';
+    if (map == MAP_FAILED) {
+        // i.e. a filesystem without mmap support
+        ErrCode stat = readAll(fd, file);
+        close(fd);
+        if (stat != SUCCESS)
+            fprintf(stderr, "Error reading file into memory '%s'\n", filepath);
+        return stat;
+    }
+    close(fd);
 
-    fclose(fp);
+    // source is read front to back exactly once. Advice values are not
+    // flags, so each takes a call of its own; failing one is harmless
+    auto advise = [&](int advice, const char* name) {
+        if (madvise(map, filesize, advice) != 0)
+            fprintf(stderr, "madvise(%s) failed on '%s': %s\n", name, filepath, strerror(errno));
+    };
+    advise(MADV_SEQUENTIAL, "MADV_SEQUENTIAL");
+#ifndef MAP_POPULATE
+    advise(MADV_WILLNEED, "MADV_WILLNEED");
+#endif
 
+    file.map = map;
+    file.map_sz = map_sz;
+    file.buf = (const char*)map;
+    file.sz = filesize;
     return SUCCESS;
 }
 
-void dumpSourceListing(char* source_buf) {
+InputStream::InputStream(int fd, size_t window_size) : fd(fd), window(window_size + 1) {
+    buf = window.data();
+    buf[0] = '\0';
+}
+
+size_t InputStream::refill(size_t keep_from) {
+    assert(keep_from <= len);
+
+    // keep track of where buf[0] is for error messages
+    const char* last_nl = nullptr;
+    for (const char* p = buf; (p = (const char*)memchr(p, '\n', buf + keep_from - p)); p++) {
+        lineno++;
+        last_nl = p;
+    }
+    col = last_nl ? buf + keep_from - last_nl - 1 : col + keep_from;
+
+    len -= keep_from;
+    memmove(buf, buf + keep_from, len);
+    if (len == window.size() - 1) {
+        // one token fills the whole window
+        if (len >= max_source_size) {
+            fprintf(stderr, "Token in input stream is over the limit of %zu bytes\n", max_source_size);
+            exit(1);
+        }
+        window.resize(2 * window.size() - 1);
+        buf = window.data();
+    }
+
+    ssize_t nread;
+    do {
+        nread = read(fd, buf + len, window.size() - 1 - len);
+    } while (nread < 0 and errno == EINTR);
+    if (nread <= 0) {
+        if (nread < 0)
+            fprintf(stderr, "Error reading input stream: %s\n", strerror(errno));
+        eof = true;
+        nread = 0;
+    }
+    len += nread;
+    buf[len] = '\0';
+    return nread;
+}
+
+void dumpSourceListing(const char* source_buf) {
     // returns ptr to rest of string if newline is found, or nullptr if nothing left
-    auto getnewlinebound = [](char* str) {
-        char* linebound = nullptr;
+    auto getnewlinebound = [](const char* str) {
+        const char* linebound = nullptr;
         for (; *str != '\n' && *str != '\0'; ++str)
             ;
         if (*str == '\n') {
@@ -66,7 +186,7 @@ void dumpSourceListing(char* source_buf) {
     };
 
     printf("===========================================================\n");
-    char *startofline = source_buf, *endofline = source_buf;
+    const char *startofline = source_buf, *endofline = source_buf;
     int lineno = 0;
     while ((endofline = getnewlinebound(startofline)) != nullptr) {
         printf(CYAN "%3d:" RESET, lineno);
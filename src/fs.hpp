@@ -1,18 +1,64 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
 #include "err.hpp"
 
-#define MAX_FILE_SIZE 200000
-
 void printDiv(const char* str);
 
 bool file_exists(std::string& filepath);
 bool file_exists(const char* filepath);
 
-size_t get_filesize(const char* filepath);
 std::string get_abspath(const char* relpath);
 
-[[nodiscard]] ErrCode slurpFile(char* filepath, char* contents);
-void dumpSourceListing(char* source_buf);
+// Read-only view of a source file's contents. Regular files are mmap'd
+// without copying; anything that can't be mapped (pipes, devices) is read
+// into an owned buffer instead. Either way data()[size()] is '\0', so the
+// view can be handed straight to the Scanner.
+struct SourceFile {
+    SourceFile() = default;
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    ~SourceFile();
+
+    const char* data() const { return buf; }
+    size_t size() const { return sz; }
+
+    const char* buf = "";
+    size_t sz = 0;
+    void* map = nullptr; // mapping to unmap on destruction, if any
+    size_t map_sz = 0;
+    std::string owned;   // contents when the file couldn't be mapped
+};
+
+// Token offsets are 32-bit, so larger sources are rejected
+constexpr size_t max_source_size = UINT32_MAX - 1;
+
+// FILE_ERR if the file can't be read or is over max_source_size
+[[nodiscard]] ErrCode mapFile(const char* filepath, SourceFile& file);
+
+// Bounded window over a stream that is consumed as it arrives (stdin,
+// pipes). The scanner works on buf[0:len] and calls refill() to drop what it
+// is done with and read more, so memory stays at the window size no matter
+// how long the stream is. The window only grows if a single token doesn't
+// fit in it, and the program exits if that token is over max_source_size.
+// buf[len] is always '\0'.
+struct InputStream {
+    InputStream(int fd, size_t window_size = 1 << 16);
+
+    // drop buf[0:keep_from], slide the rest to the front and read more after
+    // it. Returns number of bytes read; 0 at end of stream, which sets eof.
+    size_t refill(size_t keep_from);
+
+    int fd = -1;
+    std::vector<char> window;
+    char* buf = nullptr;
+    size_t len = 0;
+    bool eof = false;
+    // line (0-based) and column (0-based) of buf[0] in the stream
+    int lineno = 0;
+    int col = 0;
+};
+void dumpSourceListing(const char* source_buf);
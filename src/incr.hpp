@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.hpp"
+#include "cfg.hpp"
+#include "color.hpp"
+#include "expr.hpp"
+#include "parse.hpp"
+#include "scan.hpp"
+
+// An editable source buffer that keeps its tokens and top-level statements
+// up to date across edits (editor integration, watch loops).
+//
+// applyEdit() rescans from the last token boundary before the edit until a
+// new token lines up with an old one past the edit; from there on the old
+// tokens are reused with shifted offsets, since the scanner carries no state
+// between tokens. Likewise only the statements from the one holding the
+// first changed token are reparsed, until a reparsed statement ends where an
+// old statement started past the changed tokens.
+//
+// Each top-level statement is parsed into its own small Arena, so dropping a
+// reparsed statement frees its nodes right away.
+struct Document {
+    static constexpr size_t stmt_arena_size = 1 << 10;
+
+    Document(std::string source) : text(std::move(source)), tokens(text.data(), text.size()) {
+        Scanner(text.data(), text.size()).scanInto(tokens);
+        Arena unused(0); // parseFrom() gives each statement its own arena
+        Parser parser(tokens, unused);
+        parser.lazy_bodies = false; // text changes under the source ranges
+        parseFrom(parser);
+    }
+    Document(const Document&) = delete;
+    Document& operator=(const Document&) = delete;
+
+    // replace text[offset:offset+removed] with inserted
+    void applyEdit(size_t offset, size_t removed, std::string_view inserted) {
+        assert(offset + removed <= text.size());
+        long delta = long(inserted.size()) - long(removed);
+
+        // first token touching the edit; tokens before it are left as they are
+        size_t first = 0, hi = tokens.size();
+        while (first < hi) {
+            size_t mid = (first + hi) / 2;
+            if (lexemeEnd(mid) < offset)
+                first = mid + 1;
+            else
+                hi = mid;
+        }
+        size_t rescan_from = first ? lexemeEnd(first - 1) : 0;
+
+        text.replace(offset, removed, inserted);
+        tokens.src = text.data();
+        tokens.lines = LineIndex(text.data(), text.size());
+
+        // rescan until a token matches an old one that starts past the edit
+        TokenBuffer rescanned(text.data(), text.size());
+        size_t resume = tokens.size();
+        Scanner scanner(text.data(), text.size(), rescan_from, text.size());
+        for (Token tok = scanner.next(); tok.type != NONE; tok = scanner.next()) {
+            long old_offset = long(tok.offset) - delta;
+            if (old_offset >= long(offset + removed)) {
+                size_t j = std::lower_bound(tokens.offsets.begin() + first,
+                                            tokens.offsets.end(),
+                                            uint32_t(old_offset)) -
+                           tokens.offsets.begin();
+                if (j < tokens.size() and tokens.offsets[j] == old_offset and
+                    tokens.type(j) == tok.type and tokens.lengths[j] == tok.str.size() and
+                    lexemeStart(j) >= offset + removed) {
+                    resume = j;
+                    break;
+                }
+            }
+            rescanned.push(tok.type, tok.offset, tok.str.size(), tok.num);
+        }
+
+        // splice in place: tokens[:first] + rescanned + tokens[resume:] shifted by delta
+        size_t changed_end = first + rescanned.size();
+        tokens.replace(first, resume, rescanned);
+        for (size_t i = changed_end; i < tokens.size(); i++)
+            tokens.offsets[i] += delta;
+
+        // reparse from the statement holding token first-1, as the parser may
+        // have looked one token past the end of that statement
+        size_t stmt = std::upper_bound(stmt_starts.begin(),
+                                       stmt_starts.end(),
+                                       first ? first - 1 : 0) -
+                      stmt_starts.begin();
+        stmt = stmt ? stmt - 1 : 0;
+        size_t parse_from = stmt < stmt_starts.size() ? stmt_starts[stmt] : 0;
+
+        // old statements starting in the reused tokens may be kept
+        std::vector<Expr*> tail;
+        std::vector<size_t> tail_starts;
+        std::vector<Arena> tail_arenas;
+        for (size_t k = stmt; k < statements.size(); k++) {
+            if (stmt_starts[k] >= resume) {
+                tail.push_back(statements[k]);
+                tail_starts.push_back(stmt_starts[k] - resume + changed_end);
+                tail_arenas.push_back(std::move(arenas[k]));
+            }
+        }
+        statements.resize(stmt);
+        stmt_starts.resize(stmt);
+        arenas.resize(stmt);
+
+        Arena unused(0);
+        Parser parser(TokenStream(tokens, parse_from), unused);
+        parser.lazy_bodies = false;
+        size_t sync = parseFrom(parser, &tail_starts);
+        last_rescanned = rescanned.size();
+        last_reparsed = statements.size() - stmt;
+
+        // keep the old statements from the one the parser stopped on
+        size_t keep = std::lower_bound(tail_starts.begin(), tail_starts.end(), sync) -
+                      tail_starts.begin();
+        if (keep < tail.size() and tail_starts[keep] != sync)
+            keep = tail.size();
+        for (size_t k = keep; k < tail.size(); k++) {
+            statements.push_back(tail[k]);
+            stmt_starts.push_back(tail_starts[k]);
+            arenas.push_back(std::move(tail_arenas[k]));
+        }
+
+        if (parseVerbose)
+            fprintf(stderr,
+                    GREEN "edit at %zu: rescanned %zu tokens, reparsed %zu statements\n" RESET,
+                    offset,
+                    last_rescanned,
+                    last_reparsed);
+    }
+
+    // parse statements until end of input, or until the parser reaches one of
+    // the (sorted) token indices in sync_starts. Returns where it stopped.
+    size_t parseFrom(Parser& parser, const std::vector<size_t>* sync_starts = nullptr) {
+        while (not parser.endoftokens() and 0 < parser.getPrefixPrecedence()) {
+            size_t pos = parser.getTokenPos();
+            if (sync_starts and std::binary_search(sync_starts->begin(), sync_starts->end(), pos))
+                return pos;
+            stmt_starts.push_back(pos);
+            arenas.emplace_back(stmt_arena_size);
+            parser.arena = &arenas.back();
+            statements.push_back(parser.ParseStatement());
+        }
+        return parser.getTokenPos();
+    }
+
+    // source extent of token i, including the quotes around string literals
+    size_t lexemeStart(size_t i) const { return tokens.offsets[i] - (tokens.type(i) == STRING); }
+    size_t lexemeEnd(size_t i) const {
+        size_t end = tokens.offsets[i] + tokens.lengths[i] + (tokens.type(i) == STRING);
+        return std::min(end, text.size());
+    }
+
+    std::string text;
+    TokenBuffer tokens;
+    std::vector<Expr*> statements;
+    std::vector<size_t> stmt_starts; // index of first token of each statement
+    std::vector<Arena> arenas;       // nodes of each statement
+    // work done by the last applyEdit(), for tooling
+    size_t last_rescanned = 0;
+    size_t last_reparsed = 0;
+};
@@ -1,14 +1,21 @@
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 #include <ctype.h>
+#include <unistd.h>
 
 #include "cfg.hpp"
 #include "codegen.hpp"
 #include "color.hpp"
+#include "compile.hpp"
 #include "err.hpp"
+#include "flat.hpp"
+#include "fold.hpp"
 #include "fs.hpp"
 #include "parse.hpp"
+#include "printer.hpp"
 #include "re.hpp"
+#include "regcodegen.hpp"
 #include "scan.hpp"
 #include "time.hpp"
 #include "vm.hpp"
@@ -17,57 +24,153 @@ ErrCode run_file(char* filepath, bool dump_source) {
 
     auto starttime = getTime();
 
-    char source_buf[MAX_FILE_SIZE];
+    SourceFile source;
     printDiv("Read File");
     starttime = getTime();
-    ErrCode stat = slurpFile(filepath, source_buf);
-    printf(YELLOW "Read File took %.3g ms\n" RESET, timeSinceMilli(starttime));
+    ErrCode stat = mapFile(filepath, source);
+    printf(YELLOW "Read File took %.3g ms for %ld bytes\n" RESET,
+           timeSinceMilli(starttime),
+           source.size());
     if (stat != SUCCESS)
         return stat;
 
     if (dump_source) {
         printDiv("Source Listing");
-        dumpSourceListing(source_buf);
+        dumpSourceListing(source.data());
     }
 
     if (!run_scan) {
         return ErrCode::SUCCESS;
     }
-    printDiv("Scanner");
-    starttime = getTime();
-    Scanner scanner(source_buf);
-    auto tokens = scanner.scan();
-    printf(YELLOW "Scanner took %.3g ms for %ld tokens\n" RESET,
-           timeSinceMilli(starttime),
-           tokens.size());
+    Scanner scanner(source.data(), source.size());
+    if (single_pass) {
+        printDiv("Single-pass Compile");
+        Compiler compiler(scanner);
+        compiler.genCode();
+        return SUCCESS;
+    }
+    Arena arena;
+    std::vector<Expr*> statements;
+    if (stream_tokens and run_parse) {
+        printDiv("Scanner + Parser");
+        starttime = getTime();
+        Parser parser(scanner, arena);
+        statements = parser.ParseStatements();
+        printf(YELLOW "Scanner + Parser took %.3g ms for %d tokens\n" RESET,
+               timeSinceMilli(starttime),
+               parser.getTokenPos());
+    } else {
+        printDiv("Scanner");
+        starttime = getTime();
+        TokenBuffer tokens = scanner.scan();
+        printf(YELLOW "Scanner took %.3g ms for %ld tokens\n" RESET,
+               timeSinceMilli(starttime),
+               tokens.size());
+
+        if (!run_parse) {
+            return ErrCode::SUCCESS;
+        }
+        printDiv("Parser");
+        starttime = getTime();
+        Parser parser(tokens, arena);
+        statements = parser.ParseStatements();
+        printf(YELLOW "Parser took %.3g ms\n" RESET, timeSinceMilli(starttime));
+    }
 
-    if (!run_parse) {
-        return ErrCode::SUCCESS;
+    if (fold_constants) {
+        printDiv("Fold");
+        starttime = getTime();
+        Folder folder(arena);
+        folder.foldProgram(statements);
+        printf(YELLOW "Fold took %.3g ms for %zu nodes\n" RESET,
+               timeSinceMilli(starttime),
+               folder.nfolded);
+    }
+
+    FlatAst flat;
+    if (flat_ast) {
+        printDiv("Flatten");
+        starttime = getTime();
+        for (auto& stmt : statements)
+            flat.addStatement(stmt);
+        printf(YELLOW "Flatten took %.3g ms for %zu nodes (%zu bytes)\n" RESET,
+               timeSinceMilli(starttime),
+               flat.nodes.size(),
+               flat.bytesUsed());
     }
-    printDiv("Parser");
-    starttime = getTime();
-    Parser parser(tokens);
-    std::vector<Expr*> statements = parser.ParseStatements();
-    printf(YELLOW "Parser took %.3g ms\n" RESET, timeSinceMilli(starttime));
 
-    printDiv("Parser Output");
-    for (auto& stmt : statements) {
-        stmt->print(0, true);
+    if (dump_ast) {
+        printDiv("Parser Output");
+        starttime = getTime();
+        Printer out;
+        for (size_t i = 0; i < statements.size(); i++) {
+            if (flat_ast)
+                flat.write(out, flat.roots[i]);
+            else
+                statements[i]->write(out, 0);
+            out.put(";\n\n");
+        }
+        size_t nbytes = out.buf.size();
+        out.flush();
+        printf(YELLOW "Parser Output took %.3g ms for %zu bytes\n" RESET,
+               timeSinceMilli(starttime),
+               nbytes);
     }
 
     printDiv("CodeGen");
-    CodeGen codegen(statements);
-    codegen.genCode();
+    if (register_vm) {
+        RegCodeGen(statements).genCode();
+    } else {
+        CodeGen codegen = flat_ast ? CodeGen(flat) : CodeGen(statements);
+        codegen.genCode();
+    }
 
     printDiv("Cleanup");
-    for (auto& stmt : statements) {
-        delete (stmt);
-    }
+    // the whole AST is freed with its arena
+    statements.clear();
+    arena.reset();
 
     printf(YELLOW "took %.3g ms\n" RESET, timeSinceMilli(starttime));
     return SUCCESS;
 }
 
+// Compile and run statements from a stream (stdin, pipes) one at a time, as
+// soon as each is complete. Only a fixed-size input window and the current
+// statement are held in memory.
+ErrCode run_stream(int fd) {
+    InputStream input(fd);
+    Scanner scanner(input);
+    if (single_pass) {
+        Compiler compiler(scanner);
+        compiler.genCode();
+        return SUCCESS;
+    }
+    Arena arena(1 << 12);
+    Parser parser(scanner, arena);
+    // one CodeGen for all statements, so functions stay defined
+    std::vector<Expr*> statements;
+    CodeGen codegen(statements);
+    RegCodeGen regcodegen(statements);
+
+    int stmtno = 0;
+    while (not parser.endoftokens()) {
+        auto starttime = getTime();
+        statements = {parser.ParseStatement()};
+        if (fold_constants)
+            statements[0] = Folder(arena).fold(statements[0]);
+        printf(YELLOW "Parsed stmt %d in %.3g ms\n" RESET, stmtno++, timeSinceMilli(starttime));
+        if (dump_ast)
+            statements[0]->print(0, true);
+
+        if (register_vm)
+            regcodegen.genCode();
+        else
+            codegen.genCode();
+        arena.reset();
+    }
+    return SUCCESS;
+}
+
 void run_prompt() { printf("prompt goes here\n"); }
 
 void run_vm() {}
@@ -76,8 +179,12 @@ int main(int argc, char** argv) {
 
     setvbuf(stdout, NULL, _IONBF, 0);
 
-    if (argc == 2) {
+    if (argc == 2 and strcmp(argv[1], "-") == 0) {
+        run_stream(STDIN_FILENO);
+    } else if (argc == 2) {
         run_file(argv[1], false);
+    } else if (argc == 1 and not isatty(STDIN_FILENO)) {
+        run_stream(STDIN_FILENO);
     } else if (argc == 1) {
         run_vm();
     } else {
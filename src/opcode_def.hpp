@@ -1,6 +1,7 @@
 #include "opcode_macros.hpp"
 
 OPCODE(OP_NOP)
+OPCODE(OP_WIDE)
 OPCODE(OP_CONST)
 OPCODE(OP_POP)
 
@@ -15,8 +16,34 @@ OPCODE(OP_AND)
 OPCODE(OP_CMP)
 OPCODE(OP_PRINT)
 
-OPCODE(OP_DEFINE_GLOBAL)
 OPCODE(OP_DEFINE_LOCAL)
+OPCODE(OP_GET_VAR)
+OPCODE(OP_GET_LOCAL)
+OPCODE(OP_SET_LOCAL)
+OPCODE(OP_GET_GLOBAL)
+OPCODE(OP_SET_GLOBAL)
+OPCODE(OP_DEFINE_FN)
 
+OPCODE(OP_CALL)
 OPCODE(OP_RET)
+
+OPCODE(OP_R_MOVE)
+OPCODE(OP_R_NOT)
+OPCODE(OP_R_NEG)
+OPCODE(OP_R_ADD)
+OPCODE(OP_R_SUB)
+OPCODE(OP_R_MULT)
+OPCODE(OP_R_DIV)
+OPCODE(OP_R_OR)
+OPCODE(OP_R_AND)
+OPCODE(OP_R_CMP)
+OPCODE(OP_R_PRINT)
+OPCODE(OP_R_DEFINE_LOCAL)
+OPCODE(OP_R_GET_VAR)
+OPCODE(OP_R_GET_GLOBAL)
+OPCODE(OP_R_SET_GLOBAL)
+OPCODE(OP_R_DEFINE_FN)
+OPCODE(OP_R_CALL)
+OPCODE(OP_R_RET)
+
 OPCODE(OP_EOF)
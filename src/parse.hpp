@@ -5,11 +5,12 @@
 #include <cstring>
 #include <ctype.h>
 
-#include <functional>
+#include <array>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include "arena.hpp"
 #include "cfg.hpp"
 #include "color.hpp"
 #include "err.hpp"
@@ -22,108 +23,83 @@
 typedef int Prec;
 static constexpr Prec PREC_NONE = -99999; // indicates prefix/infix not done 
 
-typedef std::vector<Token>::const_iterator TokIter;
-typedef std::function<Expr*(Parser&)> PrefixFn;
-typedef std::vector<std::pair<PrefixFn, Prec>> PrefixTable;
-typedef std::function<Expr*(Parser&, Expr* left)> InfixFn;
-typedef std::vector<std::pair<InfixFn, Prec>> InfixTable;
+typedef Expr* (*PrefixFn)(Parser&);
+typedef Expr* (*InfixFn)(Parser&, Expr* left);
+struct PrefixRule {
+    PrefixFn fn;
+    Prec prec;
+};
+struct InfixRule {
+    InfixFn fn;
+    Prec prec;
+};
+// indexed by TokenType; built at compile time below the Parser
+typedef std::array<PrefixRule, NUM_TOKEN_TYPES> PrefixTable;
+typedef std::array<InfixRule, NUM_TOKEN_TYPES> InfixTable;
 
+// AST nodes are allocated in the arena passed in; they live until it is
+// reset or destroyed.
 struct Parser {
     Parser() = delete;
-    Parser(const std::vector<Token>& tokens) : tokens(tokens), tokit(tokens.begin()) {
-
-        initPrefixTable(prefix_func_table);
-        prefix_func_table[LEFT_BRACE] = std::make_pair(&Parser::parseBlock, 1);
-        prefix_func_table[LEFT_PAREN] = std::make_pair(&Parser::parseGrouping, 1);
-        prefix_func_table[RET] = std::make_pair(&Parser::parseReturn, 1);
-        prefix_func_table[ID] = std::make_pair(&Parser::parseID, 5);
-        prefix_func_table[NUM] = std::make_pair(&Parser::parseNum, 5);
-        prefix_func_table[STRING] = std::make_pair(&Parser::parseString, 5);
-        prefix_func_table[TRUE] = std::make_pair(&Parser::parseBool, 5);
-        prefix_func_table[FALSE] = std::make_pair(&Parser::parseBool, 5);
-        prefix_func_table[BANG] = std::make_pair(&Parser::parseUnaryOp, 100);
-        prefix_func_table[MINUS] = std::make_pair(&Parser::parseUnaryOp, 100);
-        prefix_func_table[FOR] = std::make_pair(&Parser::parseFor, 100);
-        prefix_func_table[FN] = std::make_pair(&Parser::parseFnDef, 100);
-        prefix_func_table[IF] = std::make_pair(&Parser::parseIf, 100);
-        prefix_func_table[VAR] = std::make_pair(&Parser::parseVar, 100);
-        prefix_func_table[PRINT] = std::make_pair(&Parser::parsePrint, 100);
-
-        initInfixTable(infix_func_table);
-        infix_func_table[EQUALS] = std::make_pair(&Parser::parseBinaryOp, 10);
-        infix_func_table[COMMA] = std::make_pair(&Parser::parseCommaList, 20);
-        infix_func_table[COLON] = std::make_pair(&Parser::parseBinaryOp, 22);
-        infix_func_table[TO] = std::make_pair(&Parser::parseBinaryOp, 23);
-        infix_func_table[CMP] = std::make_pair(&Parser::parseBinaryOp, 24);
-        infix_func_table[OR] = std::make_pair(&Parser::parseBinaryOp, 25);
-        infix_func_table[AND] = std::make_pair(&Parser::parseBinaryOp, 26);
-        infix_func_table[PLUS] = std::make_pair(&Parser::parseBinaryOp, 30);
-        infix_func_table[MINUS] = std::make_pair(&Parser::parseBinaryOp, 30);
-        infix_func_table[DIV] = std::make_pair(&Parser::parseBinaryOp, 40);
-        infix_func_table[MULT] = std::make_pair(&Parser::parseBinaryOp, 40);
-        infix_func_table[BANG] = std::make_pair(&Parser::parseBinaryOp, 80);
-        infix_func_table[LEFT_PAREN] = std::make_pair(&Parser::parseCall, 100);
-        infix_func_table[LEFT_BRACKET] = std::make_pair(&Parser::parseSubscript, 100);
-    }
+    Parser(const TokenBuffer& tokens, Arena& arena) : Parser(TokenStream(tokens), arena) {}
+    Parser(Scanner& scanner, Arena& arena) : Parser(TokenStream(scanner), arena) {}
+    Parser(TokenStream tokens, Arena& arena)
+        : tokens(tokens), arena(&arena),
+          lazy_bodies(lazy_fn_bodies and this->tokens.source().size()) {}
 
-    // core Pratt parsing routine
-    Expr* ParseExpr(int precedence = 0) {
-        if (endoftokens())
-            return new EmptyExpr;
-        auto prefix_tok = *tokit;
-        auto token_pos = getTokenPos();
-        if (parseVerbose)
-            printf("CALL prefix %s:%d\n", tokit->str.c_str(), token_pos);
-        Expr* expr = getPrefixFunc(tokit->type)(*this);
+    // core Pratt parsing routine; defined below the dispatch tables
+    Expr* ParseExpr(int precedence = 0);
+    Expr* parseExprIterative(int precedence);
 
-        if (parseVerbose)
-            printf("Finding infix expr wih precedence > %d\n", precedence);
-        while (precedence < getInfixPrecedence()) {
-            if (parseVerbose)
-                printf("CALL infix %s:%d\n", tokit->str.c_str(), getTokenPos());
-            expr = getInfixFunc(tokit->type)(*this, expr);
-        }
-        if (parseVerbose)
-            printf("END prefix %s:%d\n", prefix_tok.str.c_str(), token_pos);
-
-        return expr;
+    std::vector<Expr*> ParseStatements(int precedence = 0) {
+        size_t base = pending.size();
+        parseStatementsOnto(precedence);
+        std::vector<Expr*> statements(pending.begin() + base, pending.end());
+        pending.resize(base);
+        return statements;
     }
 
-    std::vector<Expr*> ParseStatements(int precedence = 0) {
-        std::vector<Expr*> statements;
+    // push statements onto pending until one can't start a statement
+    void parseStatementsOnto(int precedence) {
         while (not endoftokens() and precedence < getPrefixPrecedence()) {
-            // printf("\nparsing statement at %s on LINE %d POS %d\n",
-            //       token_to_typestr[tokit->type],
-            //       tokit->lineno,
-            //       tokit->linepos);
-
-            auto expr = ParseExpr();
-            statements.push_back(expr);
-
-            // detect erorrs with statement termination
-            if (endoftokens() and lasttype() != RIGHT_BRACE) {
-                fprintf(stderr,
-                        RED "Hit EOF without finding statement terminator (; or }) \n" RESET);
-                exit(1);
-            } else if (currtype() != SEMICOLON and lasttype() != RIGHT_BRACE) {
-                fprintf(stderr,
-                        RED "Expected stmt terminator *before* token on line %d, pos %d\n" RESET,
-                        currtoken().lineno,
-                        currtoken().linepos);
-                exit(1);
-            } else if (currtype() == SEMICOLON) {
-                consume(); // get rid of semicolon
-            } else if (lasttype() == RIGHT_BRACE) {
-                if (parseVerbose)
-                    fprintf(stderr, RED "accepting right brace as closing statement \n" RESET);
-                // accept a right brace as implictly terminating statement
-            }
+            pending.push_back(ParseStatement());
             if (not endoftokens() and parseVerbose)
                 fprintf(stderr,
-                        GREEN "token starting next stmt is '%s'\n" RESET,
-                        currtoken().str.c_str());
+                        GREEN "token starting next stmt is '%.*s'\n" RESET,
+                        int(currtoken().str.size()),
+                        currtoken().str.data());
         }
-        return statements;
+    }
+
+    // parse one statement and its terminator. Returns as soon as the
+    // terminator is consumed, without looking at the next token, so streamed
+    // input can run each statement as soon as it is complete.
+    Expr* ParseStatement() {
+        // printf("\nparsing statement at %s on LINE %d POS %d\n",
+        //       token_to_typestr[currtype()],
+        //       tokens.lineno(currtoken()),
+        //       tokens.linepos(currtoken()));
+
+        auto expr = ParseExpr();
+
+        // detect erorrs with statement termination
+        if (endoftokens() and lasttype() != RIGHT_BRACE) {
+            fprintf(stderr, RED "Hit EOF without finding statement terminator (; or }) \n" RESET);
+            exit(1);
+        } else if (currtype() != SEMICOLON and lasttype() != RIGHT_BRACE) {
+            fprintf(stderr,
+                    RED "Expected stmt terminator *before* token on line %d, pos %d\n" RESET,
+                    tokens.lineno(currtoken()),
+                    tokens.linepos(currtoken()));
+            exit(1);
+        } else if (currtype() == SEMICOLON) {
+            consume(); // get rid of semicolon
+        } else if (lasttype() == RIGHT_BRACE) {
+            if (parseVerbose)
+                fprintf(stderr, RED "accepting right brace as closing statement \n" RESET);
+            // accept a right brace as implictly terminating statement
+        }
+        return expr;
     }
 
     ///////////////////////////////////////////////////////////////////////////
@@ -131,30 +107,30 @@ struct Parser {
     // NOTE: parsing functions must consume what they use!
     static NameExpr* parseID(Parser& parser) {
         assert(parser.currtype() == ID);
-        return new NameExpr((parser.consume()).str);
+        return parser.make<NameExpr>(parser.arena->str(parser.consume().str));
     }
     static NumExpr* parseNum(Parser& parser) {
         assert(parser.currtype() == NUM);
-        return new NumExpr(atof(parser.consume().str.c_str()));
+        return parser.make<NumExpr>(parser.consume().num);
     }
     static StringExpr* parseString(Parser& parser) {
         assert(parser.currtype() == STRING);
-        return new StringExpr(parser.consume().str);
+        return parser.make<StringExpr>(parser.arena->str(parser.consume().str));
     }
     static BoolExpr* parseBool(Parser& parser) {
         assert(parser.currtype() == TRUE or parser.currtype() == FALSE);
-        return new BoolExpr(parser.consume().type == TRUE);
+        return parser.make<BoolExpr>(parser.consume().type == TRUE);
     }
     static UnaryOpExpr* parseUnaryOp(Parser& parser) {
         TokenType type = parser.consume().type;
         auto right = parser.ParseExpr(parser.getPrefixPrec(type));
-        return new UnaryOpExpr(type, right);
+        return parser.make<UnaryOpExpr>(type, right);
     }
     static Expr* parseGrouping(Parser& parser) {
         parser.consume(); // consume left paren
         if (parser.currtype() == RIGHT_PAREN) {
             parser.consume();
-            return new EmptyExpr;
+            return parser.make<EmptyExpr>();
         }
         auto expr = parser.ParseExpr(parser.getPrefixPrec(LEFT_PAREN));
         TokenType right_paren = parser.consume().type; // consume right paren
@@ -163,41 +139,39 @@ struct Parser {
     }
     static PrintExpr* parsePrint(Parser& parser) {
         parser.consume();
-        return new PrintExpr(parser.ParseExpr(0));
+        return parser.make<PrintExpr>(parser.ParseExpr(0));
     }
     static ReturnExpr* parseReturn(Parser& parser) {
         parser.consume();
         auto expr = parser.ParseExpr(parser.getPrefixPrec(RET));
-        return new ReturnExpr(expr);
+        return parser.make<ReturnExpr>(expr);
     }
     static VarExpr* parseVar(Parser& parser) {
         parser.consume();
         auto expr = parser.ParseExpr(0);
-        return new VarExpr(expr);
+        return parser.make<VarExpr>(expr);
     }
     static BlockExpr* parseBlock(Parser& parser) {
         parser.consume(); // consume brace
-        std::vector<Expr*> statements;
-        if (parser.currtype() == RIGHT_BRACE) {
-            // handle empty block
-            statements = {};
-        } else {
+        size_t base = parser.pending.size();
+        if (parser.currtype() != RIGHT_BRACE) {
             if (parseVerbose)
                 printf(MAGENTA "start parsing block\n" RESET);
-            statements = parser.ParseStatements();
+            parser.parseStatementsOnto(0);
             if (parseVerbose)
                 printf(MAGENTA "done parsing block\n" RESET);
         }
+        auto statements = parser.popPending(base);
         auto last_token_type = parser.consume().type; // consume brace
         assert(last_token_type == RIGHT_BRACE &&
                "expected closing right-brace when parsing block expr");
-        return new BlockExpr(statements);
+        return parser.make<BlockExpr>(statements);
     }
     static ForExpr* parseFor(Parser& parser) {
         parser.consume();
         // parse id
         assert(parser.currtype() == ID);
-        auto loop_var = new NameExpr(parser.consume().str);
+        auto loop_var = parser.make<NameExpr>(parser.arena->str(parser.consume().str));
         // parse colon
         assert(parser.currtype() == COLON);
         parser.consume();
@@ -205,7 +179,7 @@ struct Parser {
         auto range_expr = parser.ParseExpr(0);
         auto loop_body = parser.ParseExpr(0);
 
-        return new ForExpr(loop_var, range_expr, loop_body);
+        return parser.make<ForExpr>(loop_var, range_expr, loop_body);
     }
     static IfExpr* parseIf(Parser& parser) {
 
@@ -219,7 +193,7 @@ struct Parser {
 
         // parse else clause if it exists
         bool has_else = false;
-        Expr* else_body = new EmptyExpr();
+        Expr* else_body = parser.make<EmptyExpr>();
         if (parser.currtype() == ELSE) {
             // consume else
             parser.consume();
@@ -228,7 +202,7 @@ struct Parser {
             has_else = true;
         }
 
-        return new IfExpr(has_else, if_cond, if_body, else_body);
+        return parser.make<IfExpr>(has_else, if_cond, if_body, else_body);
     }
 
     ///////////////////////////////////////////////////////////////////////////
@@ -238,12 +212,12 @@ struct Parser {
         TokenType type = parser.consume().type;
         // get right hand side
         auto right = parser.ParseExpr(parser.getInfixPrec(type));
-        return new BinaryOpExpr(left, type, right);
+        return parser.make<BinaryOpExpr>(left, type, right);
     }
 
     static CallExpr* parseCall(Parser& parser, Expr* left) {
         assert(left->isNameExpr());
-        auto fn_name = dynamic_cast<NameExpr*>(left);
+        auto fn_name = left->asName();
         parser.consume(); // consume paren
         Expr* args;
         if (parser.currtype() != RIGHT_PAREN) {
@@ -251,11 +225,11 @@ struct Parser {
             // weakly on RHS
             args = parser.ParseExpr(0);
         } else {
-            args = new EmptyExpr;
+            args = parser.make<EmptyExpr>();
         }
         TokenType right_paren = parser.consume().type; // consume paren
         assert(right_paren && "expected paren when parsing call expr");
-        return new CallExpr(fn_name, args);
+        return parser.make<CallExpr>(fn_name, args);
     }
 
     static FnDefExpr* parseFnDef(Parser& parser) {
@@ -267,7 +241,7 @@ struct Parser {
 
         // parse id
         assert(parser.currtype() == ID);
-        auto fn_name = new NameExpr(parser.currtoken().str);
+        auto fn_name = parser.make<NameExpr>(parser.arena->str(parser.currtoken().str));
         parser.consume();
 
         // parse LEFT_PAREN
@@ -280,17 +254,30 @@ struct Parser {
             // weakly on RHS
             args = parser.ParseExpr(0);
         } else {
-            args = new EmptyExpr;
+            args = parser.make<EmptyExpr>();
         }
 
         // parse RIGHT_PAREN
         assert(parser.consume().type && "expected right-paren when parsing FnDefExpr");
 
-        // parse body
+        // parse body, or just find its end and keep its source range
         assert(parser.currtype() && "expected BlockExpr starting with '{' as body of function");
-        Expr* body = parser.ParseExpr(0);
+        Expr* body;
+        if (parser.lazy_bodies and parser.currtype() == LEFT_BRACE) {
+            uint32_t begin = parser.currtoken().offset;
+            if (not parser.tokens.skipBraces()) {
+                fprintf(stderr, RED "Hit EOF inside body of fn '%.*s'\n" RESET,
+                        int(fn_name->name.size()),
+                        fn_name->name.data());
+                exit(1);
+            }
+            uint32_t end = parser.tokens.prev_tok.offset + 1;
+            body = parser.make<LazyBlockExpr>(parser.tokens.source(), begin, end);
+        } else {
+            body = parser.ParseExpr(0);
+        }
 
-        return new FnDefExpr(fn_name, args, body);
+        return parser.make<FnDefExpr>(fn_name, args, body);
     }
 
     static SubscriptExpr* parseSubscript(Parser& parser, Expr* array_name) {
@@ -305,84 +292,251 @@ struct Parser {
         }
         TokenType right_bracket = parser.consume().type; // consume bracket
         assert(right_bracket && "expected closing right-bracket when parsing subscript expr");
-        return new SubscriptExpr(array_name, index_expr);
+        return parser.make<SubscriptExpr>(array_name, index_expr);
     }
 
     static CommaListExpr* parseCommaList(Parser& parser, Expr* first_elem) {
         parser.consume(); // consume comma
-        std::vector<Expr*> list_elems = {first_elem};
-        list_elems.push_back(parser.ParseExpr(parser.getInfixPrec(COMMA)));
+        size_t base = parser.pending.size();
+        parser.pending.push_back(first_elem);
+        parser.pending.push_back(parser.ParseExpr(parser.getInfixPrec(COMMA)));
 
         // add items to list as long as they are available
         while (parser.currtype() == COMMA) {
             parser.consume(); // consume comma
-            list_elems.push_back(parser.ParseExpr(0));
+            parser.pending.push_back(parser.ParseExpr(0));
         }
 
-        return new CommaListExpr(list_elems);
+        return parser.make<CommaListExpr>(parser.popPending(base));
     }
 
     static Expr* prefixboom(Parser& parser) {
         fprintf(stderr,
                 RED "prefixFunc for token type %s unimplemented.\n" RESET,
-                token_to_typestr[parser.tokit->type]);
+                token_to_typestr[parser.currtype()]);
         exit(1);
-        return new Expr();
+        return nullptr;
     }
     static Expr* infixboom(Parser& parser, Expr*) {
         fprintf(stderr,
                 RED "infixFunc for token type %s unimplemented.\n" RESET,
-                token_to_typestr[parser.tokit->type]);
+                token_to_typestr[parser.currtype()]);
         exit(1);
-        return new Expr();
+        return nullptr;
     }
 
     // Helper functions
-    int getTokenPos() { return tokit - tokens.begin(); }
+    int getTokenPos() { return tokens.pos(); }
 
-    Prec getInfixPrecedence() { return endoftokens() ? PREC_NONE : getInfixPrec(tokit->type); }
-    Prec getPrefixPrecedence() { return endoftokens() ? PREC_NONE : getPrefixPrec(tokit->type); }
-
-    // initialize function tables
-    void initPrefixTable(PrefixTable& functable) {
-        functable.resize(NUM_TOKEN_TYPES);
-        for (int i = 0; i < NUM_TOKEN_TYPES; i++) {
-            prefix_func_table[i] = std::make_pair(&prefixboom, PREC_NONE);
-        }
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        return arena->make<T>(std::forward<Args>(args)...);
     }
-    void initInfixTable(InfixTable& functable) {
-        functable.resize(NUM_TOKEN_TYPES);
-        std::fill(functable.begin(), functable.end(), std::make_pair(&infixboom, PREC_NONE));
+    // move pending[base:] into the arena
+    ArenaArray<Expr*> popPending(size_t base) {
+        auto list = arena->array(pending.data() + base, pending.size() - base);
+        pending.resize(base);
+        return list;
     }
 
-    // accessors for prefix and infix function tables
-    PrefixFn getPrefixFunc(TokenType toktype) {
-        assert(toktype < prefix_func_table.size());
-        return prefix_func_table[toktype].first;
-    }
-    InfixFn getInfixFunc(TokenType toktype) {
-        assert(toktype < infix_func_table.size());
-        return infix_func_table[toktype].first;
-    }
-    Prec getPrefixPrec(TokenType toktype) {
-        assert(toktype < prefix_func_table.size());
-        return prefix_func_table[toktype].second;
-    }
-    Prec getInfixPrec(TokenType toktype) {
-        assert(toktype < infix_func_table.size());
-        return infix_func_table[toktype].second;
-    }
+    Prec getInfixPrecedence() { return endoftokens() ? PREC_NONE : getInfixPrec(currtype()); }
+    Prec getPrefixPrecedence() { return endoftokens() ? PREC_NONE : getPrefixPrec(currtype()); }
+
+    // accessors for prefix and infix function tables, defined below them
+    static PrefixFn getPrefixFunc(TokenType toktype);
+    static InfixFn getInfixFunc(TokenType toktype);
+    static Prec getPrefixPrec(TokenType toktype);
+    static Prec getInfixPrec(TokenType toktype);
 
     // token stream manipulation
-    const Token& consume() { return *(tokit++); };
-    const Token& currtoken() { return *tokit; };
-    TokenType currtype() { return endoftokens() ? NONE : tokit->type; };
-    TokenType lasttype() { return std::prev(tokit)->type; };
-    bool endoftokens() { return tokit == tokens.end(); };
+    const Token& consume() { return tokens.consume(); };
+    const Token& currtoken() { return tokens.curr(); };
+    TokenType currtype() { return tokens.currtype(); };
+    TokenType lasttype() { return tokens.lasttype(); };
+    bool endoftokens() { return tokens.eof(); };
 
     // variables
-    PrefixTable prefix_func_table;
-    InfixTable infix_func_table;
-    const std::vector<Token>& tokens;
-    TokIter tokit;
+    TokenStream tokens;
+    Arena* arena;
+    // skip fn bodies, see lazy_fn_bodies; needs tokens.source()
+    bool lazy_bodies;
+    // child lists (block statements, comma list items) under construction;
+    // nested lists stack on top of their parent's
+    std::vector<Expr*> pending;
+    // operators still waiting for their right operand in parseExprIterative();
+    // nested calls stack on top of their caller's
+    struct OpFrame {
+        Expr* left; // nullptr for unary operators and open parens
+        TokenType type;
+        Prec prec;
+    };
+    std::vector<OpFrame> op_stack;
 };
+
+///////////////////////////////////////////////////////////////////////////
+// Pratt dispatch tables
+//
+// One entry per token type in token_types.inc, built at compile time. Token
+// types without a rule dispatch to prefixboom/infixboom. The parse functions
+// return their own node types, so entries go through asPrefix/asInfix, which
+// compile down to a direct call.
+
+template <auto parse>
+Expr* asPrefix(Parser& parser) { return parse(parser); }
+template <auto parse>
+Expr* asInfix(Parser& parser, Expr* left) { return parse(parser, left); }
+
+constexpr PrefixTable makePrefixTable() {
+    PrefixTable table = {};
+    for (auto& rule : table)
+        rule = {&Parser::prefixboom, PREC_NONE};
+    table[LEFT_BRACE] = {&asPrefix<&Parser::parseBlock>, 1};
+    table[LEFT_PAREN] = {&asPrefix<&Parser::parseGrouping>, 1};
+    table[RET] = {&asPrefix<&Parser::parseReturn>, 1};
+    table[ID] = {&asPrefix<&Parser::parseID>, 5};
+    table[NUM] = {&asPrefix<&Parser::parseNum>, 5};
+    table[STRING] = {&asPrefix<&Parser::parseString>, 5};
+    table[TRUE] = {&asPrefix<&Parser::parseBool>, 5};
+    table[FALSE] = {&asPrefix<&Parser::parseBool>, 5};
+    table[BANG] = {&asPrefix<&Parser::parseUnaryOp>, 100};
+    table[MINUS] = {&asPrefix<&Parser::parseUnaryOp>, 100};
+    table[FOR] = {&asPrefix<&Parser::parseFor>, 100};
+    table[FN] = {&asPrefix<&Parser::parseFnDef>, 100};
+    table[IF] = {&asPrefix<&Parser::parseIf>, 100};
+    table[VAR] = {&asPrefix<&Parser::parseVar>, 100};
+    table[PRINT] = {&asPrefix<&Parser::parsePrint>, 100};
+    return table;
+}
+
+constexpr InfixTable makeInfixTable() {
+    InfixTable table = {};
+    for (auto& rule : table)
+        rule = {&Parser::infixboom, PREC_NONE};
+    table[EQUALS] = {&asInfix<&Parser::parseBinaryOp>, 10};
+    table[COMMA] = {&asInfix<&Parser::parseCommaList>, 20};
+    table[COLON] = {&asInfix<&Parser::parseBinaryOp>, 22};
+    table[TO] = {&asInfix<&Parser::parseBinaryOp>, 23};
+    table[CMP] = {&asInfix<&Parser::parseBinaryOp>, 24};
+    table[OR] = {&asInfix<&Parser::parseBinaryOp>, 25};
+    table[AND] = {&asInfix<&Parser::parseBinaryOp>, 26};
+    table[PLUS] = {&asInfix<&Parser::parseBinaryOp>, 30};
+    table[MINUS] = {&asInfix<&Parser::parseBinaryOp>, 30};
+    table[DIV] = {&asInfix<&Parser::parseBinaryOp>, 40};
+    table[MULT] = {&asInfix<&Parser::parseBinaryOp>, 40};
+    table[BANG] = {&asInfix<&Parser::parseBinaryOp>, 80};
+    table[LEFT_PAREN] = {&asInfix<&Parser::parseCall>, 100};
+    table[LEFT_BRACKET] = {&asInfix<&Parser::parseSubscript>, 100};
+    return table;
+}
+
+static constexpr PrefixTable prefix_table = makePrefixTable();
+static constexpr InfixTable infix_table = makeInfixTable();
+
+static_assert(prefix_table[NUM].prec == 5 and infix_table[MULT].prec == 40);
+static_assert(prefix_table[SEMICOLON].prec == PREC_NONE and infix_table[NONE].prec == PREC_NONE);
+
+inline PrefixFn Parser::getPrefixFunc(TokenType toktype) {
+    assert(toktype < NUM_TOKEN_TYPES);
+    return prefix_table[toktype].fn;
+}
+inline InfixFn Parser::getInfixFunc(TokenType toktype) {
+    assert(toktype < NUM_TOKEN_TYPES);
+    return infix_table[toktype].fn;
+}
+inline Prec Parser::getPrefixPrec(TokenType toktype) {
+    assert(toktype < NUM_TOKEN_TYPES);
+    return prefix_table[toktype].prec;
+}
+inline Prec Parser::getInfixPrec(TokenType toktype) {
+    assert(toktype < NUM_TOKEN_TYPES);
+    return infix_table[toktype].prec;
+}
+
+// core Pratt parsing routine
+inline Expr* Parser::ParseExpr(int precedence) {
+    if (iterative_parse)
+        return parseExprIterative(precedence);
+    if (endoftokens())
+        return make<EmptyExpr>();
+    auto token_pos = getTokenPos();
+    // copy, streamed tokens don't outlive the next scan
+    std::string prefix_str = parseVerbose ? std::string(currtoken().str) : "";
+    if (parseVerbose)
+        printf("CALL prefix %s:%d\n", prefix_str.c_str(), token_pos);
+    Expr* expr = getPrefixFunc(currtype())(*this);
+
+    if (parseVerbose)
+        printf("Finding infix expr wih precedence > %d\n", precedence);
+    while (precedence < getInfixPrecedence()) {
+        if (parseVerbose)
+            printf("CALL infix %.*s:%d\n",
+                   int(currtoken().str.size()),
+                   currtoken().str.data(),
+                   getTokenPos());
+        expr = getInfixFunc(currtype())(*this, expr);
+    }
+    if (parseVerbose)
+        printf("END prefix %s:%d\n", prefix_str.c_str(), token_pos);
+
+    return expr;
+}
+
+// Same grammar as the recursive ParseExpr, but binary and unary operators and
+// parenthesized groups are kept on op_stack instead of recursing into
+// parseBinaryOp/parseUnaryOp/parseGrouping, so long operator chains and deep
+// parens parse in constant native stack. An operator is reduced once the next
+// infix operator doesn't bind tighter than it, exactly where the recursive
+// call for its right operand would have returned.
+inline Expr* Parser::parseExprIterative(int precedence) {
+    constexpr PrefixFn unary_op = &asPrefix<&Parser::parseUnaryOp>;
+    constexpr PrefixFn grouping = &asPrefix<&Parser::parseGrouping>;
+    constexpr InfixFn binary_op = &asInfix<&Parser::parseBinaryOp>;
+    size_t base = op_stack.size();
+    for (;;) {
+        // operand
+        Expr* expr;
+        if (endoftokens()) {
+            expr = make<EmptyExpr>();
+        } else if (getPrefixFunc(currtype()) == unary_op) {
+            TokenType type = consume().type;
+            op_stack.push_back({nullptr, type, getPrefixPrec(type)});
+            continue;
+        } else if (getPrefixFunc(currtype()) == grouping) {
+            TokenType type = consume().type;
+            if (currtype() != RIGHT_PAREN) {
+                op_stack.push_back({nullptr, type, getPrefixPrec(type)});
+                continue;
+            }
+            consume();
+            expr = make<EmptyExpr>();
+        } else {
+            expr = getPrefixFunc(currtype())(*this);
+        }
+
+        // infix operators binding tighter than the innermost open operator
+        for (;;) {
+            Prec prec = op_stack.size() > base ? op_stack.back().prec : precedence;
+            Prec infix_prec = getInfixPrecedence();
+            if (prec < infix_prec) {
+                if (getInfixFunc(currtype()) == binary_op) {
+                    op_stack.push_back({expr, consume().type, infix_prec});
+                    break;
+                }
+                expr = getInfixFunc(currtype())(*this, expr);
+                continue;
+            }
+            if (op_stack.size() == base)
+                return expr;
+            OpFrame op = op_stack.back();
+            op_stack.pop_back();
+            if (op.left) {
+                expr = make<BinaryOpExpr>(op.left, op.type, expr);
+            } else if (op.type == LEFT_PAREN) {
+                TokenType right_paren = consume().type; // consume right paren
+                assert(right_paren && "expected paren when parsing call expr");
+            } else {
+                expr = make<UnaryOpExpr>(op.type, expr);
+            }
+        }
+    }
+}
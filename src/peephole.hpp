@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cstdio>
+#include <vector>
+
+#include "cfg.hpp"
+#include "color.hpp"
+#include "vm.hpp"
+
+// Peephole optimizer over a Chunk's stack bytecode, run once it is generated.
+//
+// Instructions are decoded and pushed onto an output list one by one, and
+// the tail of the list is rewritten as long as a pattern matches, so the
+// rewrites cascade (CONST CONST ADD NEG becomes one CONST). Then the chunk
+// is re-encoded with a constant pool holding only the constants still used.
+// Line numbers are not carried over; no front end records them.
+//
+// level 1 rewrites that never change a value:
+//   CONST POP          -> (nothing)
+//   NEG NEG            -> (nothing)
+//   NOT NOT NOT        -> NOT
+//   CMP/AND/OR NOT NOT -> CMP/AND/OR, as these always give a bool
+// level 2 also
+//   CONST NOT/NEG      -> CONST, evaluated as the VM would
+//   CONST CONST binop  -> CONST, except bool division by False
+//   RET ...            -> RET, as there are no jumps past it
+struct PeepholeStats {
+    size_t ninstrs = 0; // instructions before the pass
+    size_t const_pop = 0;
+    size_t neg_neg = 0;
+    size_t not_not = 0;
+    size_t const_op = 0;
+    size_t dead = 0;
+
+    // instructions removed, by all rules
+    size_t removed() const { return const_pop + neg_neg + not_not + const_op + dead; }
+    void print() const {
+        printf(YELLOW "Peephole removed %zu of %zu instructions: %zu const+pop, %zu neg+neg, "
+                      "%zu not+not, %zu folded, %zu dead\n" RESET,
+               removed(),
+               ninstrs,
+               const_pop,
+               neg_neg,
+               not_not,
+               const_op,
+               dead);
+    }
+};
+
+struct Peephole {
+    Peephole(int level = opt_level) : level(level) {}
+
+    // optimize chunk and the compiled bodies of the fns it defines
+    void run(Chunk& chunk) {
+        if (level <= 0 or chunk.registers)
+            return;
+        for (auto& fn : chunk.protos)
+            if (fn->compiled)
+                run(fn->code);
+
+        out.clear();
+        dead = false;
+        for (size_t pos = 0, next; pos < chunk.size(); pos = next) {
+            Instr instr;
+            next = chunk.decode(pos, instr.op, instr.operands);
+            if (hasConst(instr.op))
+                instr.val = chunk.constant(instr.operands[0]);
+            stats.ninstrs++;
+            push(instr);
+        }
+
+        chunk.clearCode();
+        for (auto& instr : out) {
+            if (hasConst(instr.op))
+                instr.operands[0] = chunk.regConst(instr.val);
+            switch (numOperands(instr.op)) {
+            case 0: chunk.addOp(instr.op); break;
+            case 1: chunk.addOp(instr.op, {instr.operands[0]}); break;
+            default: chunk.addOp(instr.op, {instr.operands[0], instr.operands[1]}); break;
+            }
+        }
+    }
+
+    int level;
+    PeepholeStats stats;
+
+  private:
+    struct Instr {
+        OpCode op;
+        uint32_t operands[max_operands] = {};
+        Value val; // of the ConstIdx operand, if any (see hasConst())
+    };
+
+    // stack ops take at most one constant, as their first operand
+    static bool hasConst(OpCode op) { return numOperands(op) and operandKind(op, 0) == Operand::CONST; }
+
+    void push(const Instr& instr) {
+        if (dead) {
+            stats.dead++;
+            return;
+        }
+        out.push_back(instr);
+        while (rewrite())
+            ;
+        if (level >= 2 and instr.op == OP_RET)
+            dead = true;
+    }
+
+    // rewrite the tail of out once; false if no pattern matches
+    bool rewrite() {
+        size_t n = out.size();
+        auto op = [this, n](size_t back) { return back < n ? out[n - 1 - back].op : OP_NOP; };
+        auto drop = [this](size_t count, size_t& stat) {
+            out.resize(out.size() - count);
+            stat += count;
+            return true;
+        };
+
+        switch (op(0)) {
+        case OP_POP:
+            if (op(1) == OP_CONST)
+                return drop(2, stats.const_pop);
+            break;
+        case OP_NEG:
+            if (op(1) == OP_NEG)
+                return drop(2, stats.neg_neg);
+            break;
+        case OP_NOT:
+            if (op(1) == OP_NOT and
+                (op(2) == OP_NOT or op(2) == OP_CMP or op(2) == OP_AND or op(2) == OP_OR))
+                return drop(2, stats.not_not);
+            break;
+        default:
+            break;
+        }
+        if (level < 2)
+            return false;
+
+        switch (op(0)) {
+        case OP_NOT:
+        case OP_NEG:
+            if (op(1) == OP_CONST) {
+                out[n - 2].val = evalUnaryOp(op(0), out[n - 2].val);
+                return drop(1, stats.const_op);
+            }
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MULT:
+        case OP_DIV:
+        case OP_AND:
+        case OP_OR:
+        case OP_CMP: {
+            Value result;
+            if (op(1) == OP_CONST and op(2) == OP_CONST and
+                evalBinaryOp(op(0), out[n - 3].val, out[n - 2].val, result)) {
+                out[n - 3].val = result;
+                return drop(2, stats.const_op);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        return false;
+    }
+
+    std::vector<Instr> out;
+    bool dead = false; // after a RET
+};
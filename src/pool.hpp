@@ -0,0 +1,29 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// number of worker threads to use when none is requested
+inline int defaultJobs() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// Runs fn(i) for every i in [0, n) on up to `jobs` threads, one of which is
+// the calling thread. Items are handed out one at a time, so uneven items
+// balance out across threads. Returns once all items are done.
+template <typename Fn> void parallelFor(size_t n, int jobs, Fn&& fn) {
+    std::atomic<size_t> next_item{0};
+    auto worker = [&]() {
+        for (size_t i = next_item++; i < n; i = next_item++)
+            fn(i);
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < jobs and size_t(t) < n; t++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads)
+        thread.join();
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+// Output buffer for the AST pretty printers. Nodes append their text as they
+// are visited, so a whole tree is printed in one pass with no intermediate
+// strings, and written out with a single fwrite().
+struct Printer {
+    Printer& put(std::string_view str) {
+        buf.append(str);
+        return *this;
+    }
+    Printer& put(char c) {
+        buf.push_back(c);
+        return *this;
+    }
+    // same text as printf("%g"); small integers skip the printf machinery
+    Printer& num(double num) {
+        char tmp[32];
+        int len;
+        if (num > -1e6 and num < 1e6 and num == int(num) and not(num == 0 and std::signbit(num)))
+            len = std::to_chars(tmp, tmp + sizeof(tmp), int(num)).ptr - tmp;
+        else
+            len = snprintf(tmp, sizeof(tmp), "%g", num);
+        buf.append(tmp, len);
+        return *this;
+    }
+    Printer& indent(int depth) {
+        buf.append(4 * depth, ' ');
+        return *this;
+    }
+
+    // write out and empty the buffer
+    void flush(FILE* out = stdout) {
+        fwrite(buf.data(), 1, buf.size(), out);
+        buf.clear();
+    }
+
+    std::string buf;
+};
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "arena.hpp"
+#include "cfg.hpp"
+#include "expr.hpp"
+#include "fold.hpp"
+#include "parse.hpp"
+#include "scan.hpp"
+#include "util.hpp"
+#include "vm.hpp"
+
+// Register code generation: the statements are compiled into one register
+// Chunk (Chunk::registers) run by VM::execRegs().
+//
+// Registers are allocated per expression: an expression whose value is
+// asked for in register dst may use dst and any register above it, so a
+// binary op puts its left operand in dst and its right one in dst + 1.
+// Literals are never loaded, they are passed as RK constant operands, so
+// 1 + a * 2 is two instructions where stack code needs five.
+//
+// The locals of a fn body are its first registers, in the slots the Chunk
+// assigns them, and reading one takes no instruction. Temporaries start
+// above every local the body could define. Top-level vars are in the slots
+// of the GlobalTable.
+//
+// Fn bodies are compiled on their first call; fn_codegen_jobs only applies
+// to stack code.
+struct RegCodeGen {
+    RegCodeGen(std::vector<Expr*>& stmts) : stmts(&stmts) { fns.compile = compileBody; }
+
+    Chunk genCode() {
+        Chunk code;
+        code.fns = &fns;
+        code.globals = &globals;
+        code.registers = true;
+        for (auto stmt : *stmts)
+            operand(stmt, code, 0);
+        vm.run(code);
+        return code;
+    }
+
+    // FnTable::compile for a body the parser skipped, run on its first call
+    static void compileBody(FnProto& fn) {
+        Scanner scanner(fn.source.data(), fn.source.size(), fn.begin, fn.end);
+        Arena arena(1 << 12);
+        Parser parser(scanner, arena);
+        Expr* body = parser.ParseExpr(0);
+        if (fold_constants)
+            body = Folder(arena).fold(body);
+        genBody(body, fn);
+    }
+    static void genBody(Expr* body, FnProto& fn) {
+        Chunk& code = fn.code;
+        code.registers = true;
+        uint32_t temps = code.locals.size() + countVars(body);
+        code.nregs = std::max(code.nregs, temps);
+        code.addOp(OP_R_RET, {operand(body, code, temps)});
+        fn.compiled = true;
+    }
+
+    // Emit expr, returning the RK operand holding its value: a constant, a
+    // local's register, or a register from dst up. Ops computing a value
+    // write it to target instead of dst if it is given.
+    static uint32_t operand(Expr* expr, Chunk& code, uint32_t dst, int target = -1) {
+        uint32_t to = target < 0 ? dst : target;
+        switch (expr->kind) {
+        case NodeKind::NUM: return K(code, code.regConstVal<double>(expr->asNum()->num));
+        case NodeKind::BOOL: return K(code, code.regConstVal<bool>(static_cast<BoolExpr*>(expr)->val));
+        case NodeKind::STRING:
+            return K(code, code.regConstVal<std::string>(std::string(static_cast<StringExpr*>(expr)->string)));
+        case NodeKind::NAME: {
+            std::string name(expr->asName()->name);
+            int slot = code.localSlot(name);
+            if (slot >= 0)
+                return regOperand(slot);
+            if (code.globals)
+                code.addOp(OP_R_GET_GLOBAL, {R(code, to), code.globals->slot(name)});
+            else
+                code.addOp(OP_R_GET_VAR, {R(code, to), uint32_t(code.regConstVal<std::string>(name))});
+            return regOperand(to);
+        }
+        case NodeKind::UNARY_OP: {
+            auto unary = expr->asUnaryOp();
+            if (not token_to_unaryop.count(unary->type))
+                unimplemented(expr);
+            uint32_t right = operand(unary->right, code, dst);
+            code.addOp(registerOp(token_to_unaryop.at(unary->type)), {R(code, to), right});
+            return regOperand(to);
+        }
+        case NodeKind::BINARY_OP: {
+            auto bin = expr->asBinOp();
+            if (not token_to_binop.count(bin->type))
+                unimplemented(expr);
+            // the right operand must not overwrite the left one, nor
+            // redefine the local it is
+            uint32_t left = operand(bin->left, code, dst);
+            if (not(left & 1) and left != regOperand(dst) and countVars(bin->right)) {
+                code.addOp(OP_R_MOVE, {R(code, dst), left});
+                left = regOperand(dst);
+            }
+            uint32_t right = operand(bin->right, code, left == regOperand(dst) ? dst + 1 : dst);
+            code.addOp(registerOp(token_to_binop.at(bin->type)), {R(code, to), left, right});
+            return regOperand(to);
+        }
+        case NodeKind::CALL: {
+            // args in dst up, left to right
+            auto call = static_cast<CallExpr*>(expr);
+            uint32_t argc = 0;
+            forEachListItem(call->args, [&](Expr* arg) {
+                gen(arg, code, dst + argc);
+                argc++;
+            });
+            ConstIdx name_idx = code.regConstVal<std::string>(std::string(call->fn_name->name));
+            code.addOp(OP_R_CALL, {R(code, dst), uint32_t(name_idx), argc});
+            return regOperand(dst);
+        }
+        case NodeKind::PRINT: {
+            uint32_t value = operand(static_cast<PrintExpr*>(expr)->value, code, dst);
+            code.addOp(OP_R_PRINT, {value});
+            return value;
+        }
+        case NodeKind::RETURN: {
+            uint32_t value = operand(static_cast<ReturnExpr*>(expr)->value, code, dst);
+            code.addOp(OP_R_RET, {value});
+            return value;
+        }
+        case NodeKind::VAR: {
+            // var name [= expr]; the value is the var's
+            Expr* def = static_cast<VarExpr*>(expr)->expr;
+            Expr* rhs = nullptr;
+            std::string name;
+            if (auto bin = def->asBinOp(); bin and bin->type == EQUALS and bin->left->isNameExpr()) {
+                rhs = bin->right;
+                name = bin->left->asName()->name;
+            } else if (def->isNameExpr()) {
+                name = def->asName()->name;
+            } else {
+                unimplemented(expr);
+            }
+            if (code.slots) {
+                // the rhs goes straight to the slot, which it only sees once defined
+                int defined = code.localSlot(name);
+                uint32_t slot = defined >= 0 ? defined : code.newLocal(name);
+                if (rhs)
+                    gen(rhs, code, dst, slot);
+                else
+                    code.addOp(OP_R_MOVE, {R(code, slot), K(code, code.regConst(Value()))});
+                code.bindLocal(name, slot);
+                return regOperand(slot);
+            }
+            uint32_t value = rhs ? operand(rhs, code, dst) : K(code, code.regConst(Value()));
+            if (code.globals)
+                code.addOp(OP_R_SET_GLOBAL, {code.globals->slot(name), value});
+            else
+                code.addOp(OP_R_DEFINE_LOCAL, {uint32_t(code.regConstVal<std::string>(name)), value});
+            return value;
+        }
+        case NodeKind::BLOCK: {
+            for (auto stmt : static_cast<BlockExpr*>(expr)->stmts)
+                operand(stmt, code, dst);
+            return K(code, code.regConst(Value()));
+        }
+        case NodeKind::FN_DEF: {
+            auto def = static_cast<FnDefExpr*>(expr);
+            std::vector<std::string> params;
+            forEachListItem(def->args, [&](Expr* param) {
+                if (not param->isNameExpr())
+                    unimplemented(expr);
+                params.emplace_back(param->asName()->name);
+            });
+            FnProto& fn = code.defineFn(std::string(def->fn_name->name), std::move(params), OP_R_DEFINE_FN);
+            if (def->body->kind == NodeKind::LAZY_BLOCK) {
+                auto lazy = static_cast<LazyBlockExpr*>(def->body);
+                fn.source = lazy->source;
+                fn.begin = lazy->begin;
+                fn.end = lazy->end;
+                fn.code.registers = true;
+            } else {
+                genBody(def->body, fn);
+            }
+            return K(code, code.regConst(Value()));
+        }
+        default:
+            unimplemented(expr);
+        }
+    }
+    // emit expr into register target, using registers from dst up
+    static void gen(Expr* expr, Chunk& code, uint32_t dst, uint32_t target) {
+        uint32_t value = operand(expr, code, dst, target);
+        if (value != regOperand(target))
+            code.addOp(OP_R_MOVE, {R(code, target), value});
+    }
+    static void gen(Expr* expr, Chunk& code, uint32_t dst) { gen(expr, code, dst, dst); }
+
+    // number of vars defined by expr, outside fn bodies
+    static uint32_t countVars(Expr* expr) {
+        switch (expr->kind) {
+        case NodeKind::VAR: {
+            auto def = static_cast<VarExpr*>(expr)->expr->asBinOp();
+            return 1 + (def ? countVars(def->right) : 0);
+        }
+        case NodeKind::UNARY_OP: return countVars(expr->asUnaryOp()->right);
+        case NodeKind::BINARY_OP: return countVars(expr->asBinOp()->left) + countVars(expr->asBinOp()->right);
+        case NodeKind::CALL: return countVars(static_cast<CallExpr*>(expr)->args);
+        case NodeKind::PRINT: return countVars(static_cast<PrintExpr*>(expr)->value);
+        case NodeKind::RETURN: return countVars(static_cast<ReturnExpr*>(expr)->value);
+        case NodeKind::COMMA_LIST: {
+            uint32_t n = 0;
+            for (auto item : static_cast<CommaListExpr*>(expr)->exprs)
+                n += countVars(item);
+            return n;
+        }
+        case NodeKind::BLOCK: {
+            uint32_t n = 0;
+            for (auto stmt : static_cast<BlockExpr*>(expr)->stmts)
+                n += countVars(stmt);
+            return n;
+        }
+        default: return 0;
+        }
+    }
+
+    // register r of code, counted in its nregs
+    static uint32_t R(Chunk& code, uint32_t r) {
+        if (r > max_wide_operand >> 1)
+            ERR("more than %u registers in one chunk\n", (max_wide_operand >> 1) + 1);
+        code.nregs = std::max(code.nregs, r + 1);
+        return r;
+    }
+    // RK operand of constant idx
+    static uint32_t K(Chunk& code, ConstIdx idx) {
+        if (uint32_t(idx) > max_wide_operand >> 1)
+            ERR("more than %u constants in one register chunk\n", (max_wide_operand >> 1) + 1);
+        return constOperand(idx);
+    }
+    // the register version of a stack arithmetic op
+    static OpCode registerOp(OpCode op) {
+        static_assert(OP_R_CMP - OP_R_NOT == OP_CMP - OP_NOT, "R_ ops must follow the stack op order");
+        assert(op >= OP_NOT and op <= OP_CMP);
+        return OpCode(op - OP_NOT + OP_R_NOT);
+    }
+    [[noreturn]] static void unimplemented(Expr* expr) {
+        ERR("codegen for expr \n'%s' is UNIMPLEMENTED.\n", expr->str(0).c_str());
+    }
+
+    std::vector<Expr*>* stmts;
+    FnTable fns;
+    GlobalTable globals;
+    VM vm;
+};
@@ -1,14 +1,23 @@
 #pragma once
 
 #include <cassert>
+#include <cmath>
 #include <cstring>
+#include <stdint.h>
 #include <stdlib.h>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "cfg.hpp"
 #include "color.hpp"
-#include "re.hpp"
+#include "fs.hpp"
+#include "pool.hpp"
+#include "simd.hpp"
 
 #define DECL_TOKEN_TYPE(type, _) type,
 enum TokenType {
@@ -32,88 +41,408 @@ const char* token_to_repr[] = {
 };
 #undef DECL_TOKEN_TYPE
 
-// Token type used in Scanner and parser
+// array map from TokenType to its source representation as a string_view,
+// usable in constant expressions
+#define DECL_TOKEN_TYPE(_, repr) std::string_view(repr),
+constexpr std::string_view token_reprs[] = {
+#include "token_types.inc"
+};
+#undef DECL_TOKEN_TYPE
+
+///////////////////////////////////////////////////////////////////////////
+// Keyword perfect hash
+//
+// Every token in token_types.inc whose repr looks like an identifier (i.e.
+// 'for', 'True') is a keyword. These are placed into a small power-of-two
+// table with a collision-free hash found at compile time, so classifying an
+// identifier costs one hash and one string compare.
+
+struct Keyword {
+    std::string_view repr = "";
+    TokenType type = ID;
+};
+
+constexpr bool isIdStartChar(char c) {
+    return (c >= 'a' and c <= 'z') or (c >= 'A' and c <= 'Z') or c == '_';
+}
+
+constexpr bool isIdChar(char c) { return isIdStartChar(c) or (c >= '0' and c <= '9'); }
+
+constexpr bool isWhitespaceChar(char c) { return c == ' ' or c == '\t' or c == '\r' or c == '\n'; }
+
+// lead or continuation byte of a multi-byte UTF-8 char
+constexpr bool isNonAscii(char c) { return (unsigned char)c >= 0x80; }
+
+constexpr bool isKeywordRepr(std::string_view repr) {
+    return repr.size() and isIdStartChar(repr[0]);
+}
+
+static constexpr size_t KW_TABLE_SIZE = 64;
+
+// hash on length, first char and last char; seed is chosen by findKeywordSeed()
+constexpr uint32_t kwHash(std::string_view str, uint32_t seed) {
+    uint32_t first = (unsigned char)str.front();
+    uint32_t last = (unsigned char)str.back();
+    return ((first * seed) ^ (last * 31u) ^ (uint32_t(str.size()) * 7u)) & (KW_TABLE_SIZE - 1);
+}
+
+// returns smallest seed for which kwHash has no collisions among keywords, or 0 if none
+constexpr uint32_t findKeywordSeed() {
+    for (uint32_t seed = 1; seed < 4096; seed++) {
+        bool used[KW_TABLE_SIZE] = {};
+        bool collision = false;
+        for (int i = 0; i < NUM_TOKEN_TYPES and not collision; i++) {
+            if (not isKeywordRepr(token_reprs[i]))
+                continue;
+            uint32_t h = kwHash(token_reprs[i], seed);
+            collision = used[h];
+            used[h] = true;
+        }
+        if (not collision)
+            return seed;
+    }
+    return 0;
+}
+
+static constexpr uint32_t kw_seed = findKeywordSeed();
+static_assert(kw_seed != 0, "no perfect hash found for keywords in token_types.inc");
+
+constexpr std::array<Keyword, KW_TABLE_SIZE> makeKeywordTable() {
+    std::array<Keyword, KW_TABLE_SIZE> table = {};
+    for (int i = 0; i < NUM_TOKEN_TYPES; i++) {
+        if (isKeywordRepr(token_reprs[i]))
+            table[kwHash(token_reprs[i], kw_seed)] = {token_reprs[i], TokenType(i)};
+    }
+    return table;
+}
+
+static constexpr std::array<Keyword, KW_TABLE_SIZE> keyword_table = makeKeywordTable();
+
+// returns keyword TokenType for idstr, or ID if it isn't a keyword
+constexpr TokenType lookupKeyword(std::string_view idstr) {
+    const Keyword& kw = keyword_table[kwHash(idstr, kw_seed)];
+    return kw.repr == idstr ? kw.type : ID;
+}
+
+static_assert(lookupKeyword("for") == FOR and lookupKeyword("True") == TRUE);
+static_assert(lookupKeyword("fo") == ID and lookupKeyword("form") == ID);
+
+// Token type used in Scanner and parser. Tokens are views into the source
+// buffer; the source must outlive them.
 struct Token {
     TokenType type = NUM_TOKEN_TYPES;
-    const std::string str = "";
-    int lineno = 0;
-    int linepos = 0;
+    std::string_view str = "";
+    uint32_t offset = 0; // byte offset of token in source buffer
+    double num = 0;      // value of a NUM token, decoded by the scanner
+};
+
+// Maps byte offsets in a source buffer to line/column. The index of line
+// start offsets is built on first query, so scanning never pays for it.
+struct LineIndex {
+    LineIndex(const char* src, size_t sz) : src(src), sz(sz) {}
+
+    // 0-based line number of offset
+    int lineno(uint32_t offset) const {
+        build();
+        auto it = std::upper_bound(line_starts.begin(), line_starts.end(), offset);
+        return int(it - line_starts.begin()) - 1;
+    }
+    // 1-based column of offset within its line
+    int linepos(uint32_t offset) const { return offset - line_starts[lineno(offset)] + 1; }
+
+    void build() const {
+        if (line_starts.size())
+            return;
+        line_starts.push_back(0);
+        for (const char* p = src; (p = (const char*)memchr(p, '\n', src + sz - p)); p++)
+            line_starts.push_back(p - src + 1);
+    }
+
+    const char* src = nullptr;
+    size_t sz = 0;
+    mutable std::vector<uint32_t> line_starts;
+};
+
+// Struct-of-arrays token storage produced by Scanner::scan(). Only NUM tokens
+// have a value, so those are kept on the side, by token index.
+struct TokenBuffer {
+    static_assert(NUM_TOKEN_TYPES < 256, "token type must fit in a byte");
+
+    TokenBuffer(const char* src, size_t sz) : src(src), lines(src, sz) {}
+
+    void push(TokenType type, uint32_t offset, uint32_t len, double num = 0) {
+        if (type == NUM) {
+            num_tokens.push_back(types.size());
+            nums.push_back(num);
+        }
+        types.push_back(type);
+        offsets.push_back(offset);
+        lengths.push_back(len);
+    }
+    // append other[from:to] to this buffer
+    void append(const TokenBuffer& other, size_t from, size_t to) {
+        uint32_t shift = size() - from;
+        size_t first = other.numIndex(from), last = other.numIndex(to);
+        for (size_t n = first; n < last; n++)
+            num_tokens.push_back(other.num_tokens[n] + shift);
+        nums.insert(nums.end(), other.nums.begin() + first, other.nums.begin() + last);
+        types.insert(types.end(), other.types.begin() + from, other.types.begin() + to);
+        offsets.insert(offsets.end(), other.offsets.begin() + from, other.offsets.begin() + to);
+        lengths.insert(lengths.end(), other.lengths.begin() + from, other.lengths.begin() + to);
+    }
+    // replace tokens [from:to] with all of other's
+    void replace(size_t from, size_t to, const TokenBuffer& other) {
+        auto splice = [&](auto& dst, const auto& src, size_t dst_from, size_t dst_to) {
+            dst.erase(dst.begin() + dst_from, dst.begin() + dst_to);
+            dst.insert(dst.begin() + dst_from, src.begin(), src.end());
+        };
+        size_t first = numIndex(from), last = numIndex(to);
+        uint32_t shift = from + other.size() - to; // mod 2^32 if fewer tokens
+        for (size_t n = last; n < num_tokens.size(); n++)
+            num_tokens[n] += shift;
+        splice(num_tokens, other.num_tokens, first, last);
+        for (size_t n = first; n < first + other.num_tokens.size(); n++)
+            num_tokens[n] += from;
+        splice(nums, other.nums, first, last);
+        splice(types, other.types, from, to);
+        splice(offsets, other.offsets, from, to);
+        splice(lengths, other.lengths, from, to);
+    }
+    size_t size() const { return types.size(); }
+    Token operator[](size_t i) const {
+        return {type(i), std::string_view(src + offsets[i], lengths[i]), offsets[i], num(i)};
+    }
+    TokenType type(size_t i) const { return TokenType(types[i]); }
+    // value of token i if it is a NUM, else 0
+    double num(size_t i) const {
+        if (type(i) != NUM)
+            return 0;
+        return nums[numIndex(i)];
+    }
+    int lineno(size_t i) const { return lines.lineno(offsets[i]); }
+    int linepos(size_t i) const { return lines.linepos(offsets[i]); }
+
+    // bytes held by token storage (excluding the source buffer)
+    size_t bytesUsed() const {
+        return types.capacity() * sizeof(types[0]) + offsets.capacity() * sizeof(offsets[0]) +
+               lengths.capacity() * sizeof(lengths[0]) + num_tokens.capacity() * sizeof(num_tokens[0]) +
+               nums.capacity() * sizeof(nums[0]) + lines.line_starts.capacity() * sizeof(uint32_t);
+    }
+
+    const char* src = nullptr;
+    LineIndex lines;
+    std::vector<uint8_t> types;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> lengths;
+    std::vector<uint32_t> num_tokens; // index of each NUM token, ascending
+    std::vector<double> nums;         // its value
+
+  private:
+    // position in num_tokens of the first NUM token at index i or later
+    size_t numIndex(size_t i) const {
+        return std::lower_bound(num_tokens.begin(), num_tokens.end(), uint32_t(i)) - num_tokens.begin();
+    }
 };
 
 #define SINGLE_CHAR_TOKEN(__ch__, __token_type__)                                                  \
     case __ch__: {                                                                                 \
-        tok(__token_type__, str(__ch__));                                                          \
+        tok(__token_type__, _srcbuf, 1);                                                           \
         break;                                                                                     \
     }
 
-#define KW_MATCH(__token_type__, __token_str__)                                                    \
-    else if (re_match(idstr, "^" #__token_str__ "$")) {                                            \
-        return __token_type__;                                                                     \
-    }
-
 struct Scanner {
     Scanner() = delete;
-    Scanner(const char* buf) : _srcbuf(buf), _sz(strlen(buf)) {}
-    std::vector<Token> scan() {
+    Scanner(const char* buf) : Scanner(buf, strlen(buf)) {}
+    // buf[sz] must be '\0'
+    Scanner(const char* buf, size_t sz) : Scanner(buf, sz, 0, sz) {}
+    // scan only buf[begin:end]; token offsets stay relative to buf
+    Scanner(const char* buf, size_t sz, size_t begin, size_t end)
+        : _lines(buf, sz), _start(buf), _end(buf + end), _srcbuf(buf + begin), _sz(sz) {}
+    // scan out of the window of stream, refilling it as tokens are used up.
+    // Token views (and offsets) are only valid until the next call to next().
+    Scanner(InputStream& stream)
+        : _lines(stream.buf, 0), _start(stream.buf), _end(stream.buf + stream.len),
+          _srcbuf(stream.buf), _sz(0), _stream(&stream) {}
+
+    // scan the whole buffer up front; used by tooling and dumps
+    TokenBuffer scan() {
+        TokenBuffer tokens(_start, _sz);
+        scanInto(tokens);
+
+        if (dump_token_stream)
+            dumpTokenStream(tokens);
+
+        return tokens;
+    }
+
+    // Same result as scan(), but the buffer is split into chunks that are
+    // scanned on up to `jobs` threads.
+    //
+    // Chunks start just past a newline, which is outside any comment, and is
+    // assumed to be outside any string literal. A chunk whose last string
+    // literal runs into the end of the chunk breaks that assumption for the
+    // following chunks. Stitching then rescans serially from the opening
+    // quote until a token lines up with one from a later chunk. From there on
+    // that chunk's tokens are known to be right, because the scanner carries
+    // no state between tokens.
+    TokenBuffer scanParallel(int jobs = defaultJobs()) {
+        constexpr size_t min_chunk_size = 1 << 16;
+        size_t nchunks = std::min(size_t(jobs) * 2, _sz / min_chunk_size);
+        if (jobs <= 1 or nchunks < 2 or _srcbuf != _start)
+            return scan();
+
+        std::vector<size_t> bounds = {0};
+        for (size_t k = 1; k < nchunks; k++) {
+            size_t target = k * _sz / nchunks;
+            const char* nl = (const char*)memchr(_start + target, '\n', _sz - target);
+            if (nl and size_t(nl - _start + 1) > bounds.back() and size_t(nl - _start + 1) < _sz)
+                bounds.push_back(nl - _start + 1);
+        }
+        bounds.push_back(_sz);
+        nchunks = bounds.size() - 1;
+
+        std::vector<TokenBuffer> chunks(nchunks, TokenBuffer(_start, _sz));
+        std::vector<const char*> resume(nchunks, nullptr);
+        parallelFor(nchunks, jobs, [&](size_t k) {
+            Scanner chunk_scanner(_start, _sz, bounds[k], bounds[k + 1]);
+            chunk_scanner._speculative = true;
+            chunk_scanner.scanInto(chunks[k]);
+            resume[k] = chunk_scanner._resume;
+        });
+
+        // stitch chunks[k][from:] onto tokens, resyncing after bad guesses
+        TokenBuffer tokens(_start, _sz);
+        size_t k = 0, from = 0;
+        while (k < nchunks) {
+            const TokenBuffer& chunk = chunks[k];
+            if (not resume[k]) {
+                tokens.append(chunk, from, chunk.size());
+                k++, from = 0;
+                continue;
+            }
+
+            // chunk k went wrong at resume[k]; keep its tokens before that
+            _resyncs++;
+            const auto& offs = chunk.offsets;
+            uint32_t resume_offset = resume[k] - _start;
+            size_t good = std::lower_bound(offs.begin(), offs.end(), resume_offset) - offs.begin();
+            if (good > from)
+                tokens.append(chunk, from, good);
+
+            Scanner serial(_start, _sz, resume[k] - _start, _sz);
+            bool synced = false;
+            for (Token tok = serial.next(); tok.type != NONE; tok = serial.next()) {
+                size_t j = std::upper_bound(bounds.begin(), bounds.end(), tok.offset) -
+                           bounds.begin() - 1;
+                if (j > k) {
+                    const auto& sync_offs = chunks[j].offsets;
+                    size_t i = std::lower_bound(sync_offs.begin(), sync_offs.end(), tok.offset) -
+                               sync_offs.begin();
+                    if (i < sync_offs.size() and sync_offs[i] == tok.offset and
+                        chunks[j].type(i) == tok.type and chunks[j].lengths[i] == tok.str.size()) {
+                        k = j, from = i;
+                        synced = true;
+                        break;
+                    }
+                }
+                tokens.push(tok.type, tok.offset, tok.str.size(), tok.num);
+            }
+            if (not synced)
+                break;
+        }
+
+        if (dump_token_stream)
+            dumpTokenStream(tokens);
+
+        return tokens;
+    }
+
+    void scanInto(TokenBuffer& tokens) {
+        for (Token tok = next(); tok.type != NONE; tok = next())
+            tokens.push(tok.type, tok.offset, tok.str.size(), tok.num);
+    }
+
+    // scan and return the next token, or a NONE token at end of input
+    Token next() {
+        _have_tok = false;
         char ch = *_srcbuf;
-        _lineno = 0;
-        _linepos = 0;
-        while (ch != '\0') {
+        while (not _have_tok) {
+            if (_srcbuf >= _end and _stream and not _stream->eof) {
+                ch = refill(_srcbuf);
+                continue;
+            }
+            if (ch == '\0' or _srcbuf >= _end)
+                break;
+
+            const char* lexeme = _srcbuf;
+            int lookahead = 1; // chars past the lexeme the scanner may have looked at
             switch (ch) {
             case '"': {
-                int start_lineno = _lineno;
                 if (scanVerbose)
                     printf("Capturing String Literal " BRIGHTBLUE "\"");
-                ch = advance();
-                std::string str;
-                for (; ch != '"' and ch != '\0'; ch = advance()) {
-                    if (scanVerbose)
-                        printf("%c", ch);
-                    if (ch == '\n')
-                        _lineno++;
-                    str.push_back(ch);
-                }
+                const char* start = _srcbuf + 1;
+                ch = skipTo(findEither(start, _end, '"', '\0'));
                 if (scanVerbose)
-                    printf("\"" RESET " on LINE %d\n",start_lineno);
+                    printf("%.*s\"" RESET " on LINE %d\n",
+                           int(_srcbuf - start),
+                           start,
+                           lineno(start));
+
+                tok(STRING, start, _srcbuf - start);
 
-                tok(STRING, str);
+                // validate the contents once the whole literal is in view
+                bool terminated = ch == '"' and _srcbuf < _end;
+                if (terminated or not (_speculative or (_stream and not _stream->eof))) {
+                    const char* bad = validateUtf8(start, _srcbuf);
+                    if (bad != _srcbuf)
+                        badUtf8(lexeme, bad);
+                }
 
+                // unterminated literal; leave the end of input for the loop to find
+                if (ch == '\0' or _srcbuf == _end) {
+                    if (_speculative and _srcbuf == _end)
+                        _resume = start - 1;
+                    stepback();
+                }
                 break;
             }
             case '#': {
+                const char* start = _srcbuf;
+                ch = skipTo(findEither(start, _end, '\n', '\0'));
                 if (scanVerbose)
-                    printf("Commented " CYAN);
-                for (; ch != '\n' and ch != '\0'; ch = advance()) {
-                    if (scanVerbose)
-                        printf("%c", ch);
-                }
-                if (scanVerbose)
-                    printf(RESET " on LINE %d.\n", _lineno);
-                _lineno++;
+                    printf("Commented " CYAN "%.*s" RESET " on LINE %d.\n",
+                           int(_srcbuf - start),
+                           start,
+                           lineno(start));
+                if (ch == '\0' or _srcbuf == _end)
+                    stepback();
                 break;
             }
             case 'a' ... 'z':
             case 'A' ... 'Z':
-            case '_': {
-                std::string idstr = consumeId();
-                TokenType kw = getKeywordTokenType(idstr);
-                tok(kw, idstr);
+            case '_':
+            case '\x80' ... '\xff': {
+                const char* start = _srcbuf;
+                std::string_view idstr = consumeId();
+                tok(getKeywordTokenType(idstr), start, idstr.size());
+                lookahead = 4;
                 break;
             }
             case '0' ... '9': {
-                // printf("%3ld: found digit  char '%c'\n", ch);
-                tok(NUM, consumeNum());
+                const char* start = _srcbuf;
+                double num = 0;
+                tok(NUM, start, consumeNum(num).size());
+                _tok.num = num;
+                lookahead = 3;
                 break;
             }
             case '\n':
             case '\r':
             case '\t':
             case ' ': {
-                if (ch == '\n') {
-                    _lineno++;
-                    _linepos = 0;
-                }
-                // printf("%3ld: found wspace char '%c'\n", i, ch);
+                // bulk skip runs (i.e. indentation); leave _srcbuf on the last whitespace char
+                if (_srcbuf + 1 < _end and isWhitespaceChar(_srcbuf[1]))
+                    skipTo(skipWhitespace(_srcbuf + 2, _end) - 1);
                 break;
             }
                 SINGLE_CHAR_TOKEN('+', PLUS)
@@ -132,102 +461,246 @@ struct Scanner {
                 SINGLE_CHAR_TOKEN('[', LEFT_BRACKET)
                 SINGLE_CHAR_TOKEN(']', RIGHT_BRACKET)
             default: {
+                if (_speculative) {
+                    // may just be the inside of a string literal; let stitching decide
+                    _resume = _srcbuf;
+                    _end = _srcbuf;
+                    break;
+                }
                 printf("Found unimpl char '%c' (%d) at lineno %d, pos %d\n",
                        ch,
                        ch,
-                       _lineno,
-                       _linepos);
+                       lineno(_srcbuf),
+                       linepos(_srcbuf));
                 exit(0);
                 break;
             }
             }
+            // a lexeme running up to the end of a stream window may continue in
+            // the next read; rescan it once more input is in
+            if (_stream and _srcbuf + lookahead >= _end and not _stream->eof and
+                mayContinue(*lexeme)) {
+                _have_tok = false;
+                ch = refill(lexeme);
+                continue;
+            }
             ch = advance();
         }
-
-        if (dump_token_stream)
-            dumpTokenStream();
-
-        std::vector<Token> tmp;
-        std::swap(tmp, _tokens);
-        return tmp;
+        if (not _have_tok)
+            return {NONE, std::string_view(_srcbuf, 0), uint32_t(_srcbuf - _start)};
+        return _tok;
     }
-    TokenType getKeywordTokenType(const std::string& idstr) {
-        if (false) {
+    TokenType getKeywordTokenType(std::string_view idstr) { return lookupKeyword(idstr); }
+    // consume* leave _srcbuf on the last char of the token
+    std::string_view consumeId() {
+        const char* start = _srcbuf;
+        const char* pos = start;
+        if (isIdStartChar(*pos)) {
+            // most identifiers are short; only hand long ones to the bulk scanner
+            for (pos++; pos < start + 8 and isIdChar(*pos); pos++)
+                ;
+            if (pos == start + 8)
+                pos = skipIdChars(pos, _end);
         }
-        KW_MATCH(AND, and)
-        KW_MATCH(ELSE, else)
-        KW_MATCH(CMP, cmp)
-        KW_MATCH(FN, fn)
-        KW_MATCH(FOR,for)
-        KW_MATCH(VAR,var)
-        KW_MATCH(IF, if)
-        KW_MATCH(OR, or)
-        KW_MATCH(PRINT, print)
-        KW_MATCH(RET, ret)
-        KW_MATCH(TO, to)
-        KW_MATCH(TRUE, True)
-        KW_MATCH(FALSE, False)
-        else {
-            return ID;
+        // any non-ASCII char (valid UTF-8) is an identifier char
+        while (pos < _end and isNonAscii(*pos)) {
+            int len = utf8SeqLen(pos, _end);
+            if (len < 0 and _stream and not _stream->eof)
+                break; // rest of the char is in the next read; rescanned after refill
+            if (len <= 0) {
+                badUtf8(start, pos);
+                break;
+            }
+            pos = skipIdChars(pos + len, _end);
         }
+        skipTo(pos - 1);
+        return std::string_view(start, _srcbuf - start + 1);
     }
-    std::string consumeId() {
-        std::string s;
-        char ch = *_srcbuf;
-        assert(isalpha(ch) or ch == '_');
-        while (isalnum(ch) or ch == '_') {
-            s.push_back(ch);
-            ch = advance();
+    // decimal literal with optional fraction and exponent (1, 2.5, 3e-4, 6.0E8)
+    // or hex integer (0x1F); the value is decoded into num
+    std::string_view consumeNum(double& num) {
+        const char* start = _srcbuf;
+        const char* pos = start;
+        assert(isdigit(*pos));
+        std::from_chars_result res;
+        if (pos + 2 < _end and pos[0] == '0' and (pos[1] == 'x' or pos[1] == 'X') and
+            isxdigit(pos[2])) {
+            for (pos += 2; pos < _end and isxdigit(*pos); pos++)
+                ;
+            res = std::from_chars(start + 2, pos, num, std::chars_format::hex);
+        } else {
+            pos = skipDigits(pos);
+            if (pos + 1 < _end and pos[0] == '.' and isdigit(pos[1]))
+                pos = skipDigits(pos + 1);
+            if (pos < _end and (*pos == 'e' or *pos == 'E')) {
+                const char* exp = pos + 1;
+                if (exp < _end and (*exp == '+' or *exp == '-'))
+                    exp++;
+                if (exp < _end and isdigit(*exp))
+                    pos = skipDigits(exp);
+            }
+            res = std::from_chars(start, pos, num);
         }
-        stepback();
-        return s;
+        // from_chars leaves num untouched on overflow/underflow; strtod gives inf/0
+        if (res.ec == std::errc::result_out_of_range)
+            num = strtod(start, nullptr);
+        skipTo(pos - 1);
+        return std::string_view(start, pos - start);
     }
-    std::string consumeNum() {
-        std::string s;
-        char ch = *_srcbuf;
-        assert(isdigit(ch));
-        while (isdigit(ch)) {
-            s.push_back(ch);
-            ch = advance();
+    const char* skipDigits(const char* pos) {
+        while (pos < _end and isdigit(*pos))
+            pos++;
+        return pos;
+    }
+    void tok(TokenType type, const char* start, size_t len) {
+        _tok = {type, std::string_view(start, len), uint32_t(start - _start)};
+        _have_tok = true;
+    }
+    char advance() { return *(++_srcbuf); }
+    char skipTo(const char* pos) { return *(_srcbuf = pos); }
+    char stepback() { return *(--_srcbuf); }
+    static bool mayContinue(char first) {
+        return isIdChar(first) or isNonAscii(first) or first == '"' or first == '#' or
+               isWhitespaceChar(first);
+    }
+    // invalid UTF-8 at pos, within the lexeme starting at lexeme
+    void badUtf8(const char* lexeme, const char* pos) {
+        if (_speculative) {
+            // may be a comment misread as a string; let stitching decide
+            _resume = lexeme;
+            _end = lexeme;
+            return;
         }
-        stepback();
-        return s;
+        fprintf(stderr,
+                RED "Invalid UTF-8 byte 0x%02x at lineno %d, pos %d\n" RESET,
+                (unsigned char)*pos,
+                lineno(pos),
+                linepos(pos));
+        exit(1);
     }
-    std::string str(char c) { return std::string(1, c); }
-    void tok(TokenType type, std::string str) {
-        _tokens.push_back({.type = type,
-                           .str = std::move(str),
-                           .lineno = _lineno,
-                           .linepos = _linepos});
+    // stream mode: drop the window up to keep, read more input and rescan from keep
+    char refill(const char* keep) {
+        _stream->refill(keep - _start);
+        _start = _stream->buf;
+        _end = _start + _stream->len;
+        return skipTo(_start);
     }
-    char advance() {
-        _linepos++;
-        return *(++_srcbuf);
+
+    // line/col are only computed on demand (errors and dumps)
+    int lineno(const char* pos) {
+        if (_stream)
+            return _stream->lineno + std::count(_start, pos, '\n');
+        return _lines.lineno(pos - _start);
     }
-    char stepback() {
-        _linepos--;
-        return *(--_srcbuf);
+    int linepos(const char* pos) {
+        if (_stream) {
+            const char* bol = pos;
+            for (; bol > _start and bol[-1] != '\n'; bol--)
+                ;
+            return (bol == _start ? _stream->col : 0) + int(pos - bol) + 1;
+        }
+        return _lines.linepos(pos - _start);
     }
 
-    void dumpTokenStream() {
+    void dumpTokenStream(const TokenBuffer& tokens) {
         int curr_lineno = -1;
 
-        for (auto tok : _tokens) {
-            if (tok.lineno > curr_lineno) {
-                curr_lineno = tok.lineno;
+        for (size_t i = 0; i < tokens.size(); i++) {
+            Token tok = tokens[i];
+            int tok_lineno = tokens.lineno(i);
+            if (tok_lineno > curr_lineno) {
+                curr_lineno = tok_lineno;
                 printf(CYAN "LINE %d: \n" RESET, curr_lineno);
             }
-            printf("\t%-12s = %-10s at %d,%d  \n",
+            printf("\t%-12s = %-10.*s at %d,%d  \n",
                    token_to_typestr[tok.type],
-                   tok.str.c_str(),
-                   tok.lineno,
-                   tok.linepos);
+                   int(tok.str.size()),
+                   tok.str.data(),
+                   tok_lineno,
+                   tokens.linepos(i));
         }
     }
 
-    std::vector<Token> _tokens;
-    int _linepos = 0;
-    int _lineno = 1;
+    LineIndex _lines;
+    Token _tok;
+    bool _have_tok = false;
+    // set for chunks of scanParallel(): instead of reporting errors, stop and
+    // record where a serial rescan must resume
+    bool _speculative = false;
+    const char* _resume = nullptr;
+    size_t _resyncs = 0; // chunks scanParallel() rescanned serially, for tooling
+    const char* _start = nullptr;
+    const char* _end = nullptr;
     const char* _srcbuf = nullptr;
     const size_t _sz = 0;
+    InputStream* _stream = nullptr;
+};
+
+// Token source for the Parser. Either pulls tokens lazily from a Scanner, so
+// that scanning and parsing are interleaved and no token buffer is built, or
+// walks a pre-scanned TokenBuffer. Lookahead is bounded to the current
+// token, which is only scanned when first asked for, plus the last consumed
+// token. A NONE token marks end of input.
+struct TokenStream {
+    TokenStream(Scanner& scanner) : scanner(&scanner) {}
+    // walk tokens starting at index from
+    TokenStream(const TokenBuffer& tokens, size_t from = 0) : buffer(&tokens), idx(from) {}
+
+    const Token& curr() {
+        if (not fetched) {
+            if (buffer)
+                curr_tok = idx < buffer->size() ? (*buffer)[idx] : Token{NONE};
+            else
+                curr_tok = scanner->next();
+            fetched = true;
+        }
+        return curr_tok;
+    }
+    // the returned token stays valid until the next consume()
+    const Token& consume() {
+        prev_tok = curr();
+        fetched = false;
+        idx++;
+        return prev_tok;
+    }
+    TokenType currtype() { return curr().type; }
+    TokenType lasttype() { return prev_tok.type; }
+    // consume tokens through the '}' matching the current '{'; false if the
+    // input ends first
+    bool skipBraces() {
+        int depth = 0;
+        do {
+            TokenType type = consume().type;
+            depth += (type == LEFT_BRACE) - (type == RIGHT_BRACE);
+        } while (depth > 0 and not eof());
+        return depth == 0;
+    }
+    bool eof() { return currtype() == NONE; }
+    // index of the current token
+    size_t pos() { return idx; }
+    // the whole buffer token offsets are relative to, if it outlives the
+    // tokens; empty for a Scanner reading from an InputStream
+    std::string_view source() const {
+        if (buffer)
+            return std::string_view(buffer->src, buffer->lines.sz);
+        if (scanner->_stream)
+            return {};
+        return std::string_view(scanner->_start, scanner->_sz);
+    }
+
+    int lineno(const Token& tok) {
+        return buffer ? buffer->lines.lineno(tok.offset)
+                      : scanner->lineno(scanner->_start + tok.offset);
+    }
+    int linepos(const Token& tok) {
+        return buffer ? buffer->lines.linepos(tok.offset)
+                      : scanner->linepos(scanner->_start + tok.offset);
+    }
+
+    Scanner* scanner = nullptr;
+    const TokenBuffer* buffer = nullptr;
+    size_t idx = 0;
+    Token curr_tok;
+    Token prev_tok;
+    bool fetched = false;
 };
@@ -0,0 +1,296 @@
+#include <cstdint>
+
+#include "simd.hpp"
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+static inline bool isWhitespace(char c) { return c == ' ' or c == '\t' or c == '\r' or c == '\n'; }
+static inline bool isIdChar(char c) {
+    return (c >= 'a' and c <= 'z') or (c >= 'A' and c <= 'Z') or (c >= '0' and c <= '9') or
+           c == '_';
+}
+
+///////////////////////////////////////////////////////////////////////////
+// portable fallback
+
+static const char* findEitherScalar(const char* p, const char* end, char a, char b) {
+    for (; p < end and *p != a and *p != b; p++)
+        ;
+    return p;
+}
+static const char* skipWhitespaceScalar(const char* p, const char* end) {
+    for (; p < end and isWhitespace(*p); p++)
+        ;
+    return p;
+}
+static const char* skipIdCharsScalar(const char* p, const char* end) {
+    for (; p < end and isIdChar(*p); p++)
+        ;
+    return p;
+}
+static const char* findNonAsciiScalar(const char* p, const char* end) {
+    // 8 bytes at a time, then bytewise
+    for (; p + 8 <= end; p += 8) {
+        uint64_t word;
+        __builtin_memcpy(&word, p, 8);
+        if (word & 0x8080808080808080ull)
+            break;
+    }
+    for (; p < end and (unsigned char)*p < 0x80; p++)
+        ;
+    return p;
+}
+
+#ifdef HAVE_X86_SIMD
+
+///////////////////////////////////////////////////////////////////////////
+// SSE2 (baseline on x86-64)
+//
+// Each helper returns a bitmask with bit i set if byte i matches. Range
+// checks use signed compares, so bytes >= 0x80 never match.
+
+static inline uint32_t eitherMask16(__m128i v, __m128i a, __m128i b) {
+    return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)));
+}
+static inline uint32_t whitespaceMask16(__m128i v) {
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                              _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    ws = _mm_or_si128(ws, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    ws = _mm_or_si128(ws, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    return _mm_movemask_epi8(ws);
+}
+static inline __m128i inRange16(__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+static inline uint32_t idCharMask16(__m128i v) {
+    // fold upper case onto lower case: only letters land in 'a'..'z'
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i id = _mm_or_si128(inRange16(lower, 'a', 'z'), inRange16(v, '0', '9'));
+    id = _mm_or_si128(id, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    return _mm_movemask_epi8(id);
+}
+
+static const char* findEitherSSE2(const char* p, const char* end, char a, char b) {
+    __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    for (; p + 16 <= end; p += 16) {
+        uint32_t mask = eitherMask16(_mm_loadu_si128((const __m128i*)p), va, vb);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return findEitherScalar(p, end, a, b);
+}
+static const char* skipWhitespaceSSE2(const char* p, const char* end) {
+    for (; p + 16 <= end; p += 16) {
+        uint32_t mask = ~whitespaceMask16(_mm_loadu_si128((const __m128i*)p)) & 0xFFFF;
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return skipWhitespaceScalar(p, end);
+}
+static const char* skipIdCharsSSE2(const char* p, const char* end) {
+    for (; p + 16 <= end; p += 16) {
+        uint32_t mask = ~idCharMask16(_mm_loadu_si128((const __m128i*)p)) & 0xFFFF;
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return skipIdCharsScalar(p, end);
+}
+static const char* findNonAsciiSSE2(const char* p, const char* end) {
+    for (; p + 16 <= end; p += 16) {
+        uint32_t mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return findNonAsciiScalar(p, end);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// AVX2
+
+#define AVX2_FN __attribute__((target("avx2")))
+
+AVX2_FN static inline __m256i inRange32(__m256i v, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+AVX2_FN static const char* findEitherAVX2(const char* p, const char* end, char a, char b) {
+    __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+    for (; p + 32 <= end; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        uint32_t mask = _mm256_movemask_epi8(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return findEitherSSE2(p, end, a, b);
+}
+AVX2_FN static const char* skipWhitespaceAVX2(const char* p, const char* end) {
+    for (; p + 32 <= end; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                     _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        ws = _mm256_or_si256(ws, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+        ws = _mm256_or_si256(ws, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+        uint32_t mask = ~uint32_t(_mm256_movemask_epi8(ws));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return skipWhitespaceSSE2(p, end);
+}
+AVX2_FN static const char* skipIdCharsAVX2(const char* p, const char* end) {
+    for (; p + 32 <= end; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i id = _mm256_or_si256(inRange32(lower, 'a', 'z'), inRange32(v, '0', '9'));
+        id = _mm256_or_si256(id, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+        uint32_t mask = ~uint32_t(_mm256_movemask_epi8(id));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return skipIdCharsSSE2(p, end);
+}
+AVX2_FN static const char* findNonAsciiAVX2(const char* p, const char* end) {
+    // two vectors per iteration; ASCII-only input is the common case
+    for (; p + 64 <= end; p += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)p);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p + 32));
+        if (_mm256_movemask_epi8(_mm256_or_si256(a, b)))
+            break;
+    }
+    for (; p + 32 <= end; p += 32) {
+        uint32_t mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)p));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return findNonAsciiSSE2(p, end);
+}
+
+#endif // HAVE_X86_SIMD
+
+///////////////////////////////////////////////////////////////////////////
+// runtime dispatch
+
+struct SimdOps {
+    SimdLevel level;
+    const char* (*findEither)(const char*, const char*, char, char);
+    const char* (*skipWhitespace)(const char*, const char*);
+    const char* (*skipIdChars)(const char*, const char*);
+    const char* (*findNonAscii)(const char*, const char*);
+};
+
+static const SimdOps scalar_ops = {SimdLevel::SCALAR,
+                                   findEitherScalar,
+                                   skipWhitespaceScalar,
+                                   skipIdCharsScalar,
+                                   findNonAsciiScalar};
+#ifdef HAVE_X86_SIMD
+static const SimdOps sse2_ops = {
+        SimdLevel::SSE2, findEitherSSE2, skipWhitespaceSSE2, skipIdCharsSSE2, findNonAsciiSSE2};
+static const SimdOps avx2_ops = {
+        SimdLevel::AVX2, findEitherAVX2, skipWhitespaceAVX2, skipIdCharsAVX2, findNonAsciiAVX2};
+#endif
+
+static bool cpuSupports(SimdLevel level) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    switch (level) {
+    case SimdLevel::AVX2:
+        return __builtin_cpu_supports("avx2");
+    case SimdLevel::SSE2:
+        return __builtin_cpu_supports("sse2");
+    default:
+        return true;
+    }
+#else
+    return level == SimdLevel::SCALAR;
+#endif
+}
+
+static const SimdOps* opsFor(SimdLevel level) {
+#ifdef HAVE_X86_SIMD
+    if (level == SimdLevel::AVX2)
+        return &avx2_ops;
+    if (level == SimdLevel::SSE2)
+        return &sse2_ops;
+#endif
+    return &scalar_ops;
+}
+
+static const SimdOps* selectOps() {
+    if (cpuSupports(SimdLevel::AVX2))
+        return opsFor(SimdLevel::AVX2);
+    if (cpuSupports(SimdLevel::SSE2))
+        return opsFor(SimdLevel::SSE2);
+    return &scalar_ops;
+}
+
+static const SimdOps* ops = selectOps();
+
+const char* findEither(const char* p, const char* end, char a, char b) {
+    return ops->findEither(p, end, a, b);
+}
+const char* skipWhitespace(const char* p, const char* end) { return ops->skipWhitespace(p, end); }
+const char* skipIdChars(const char* p, const char* end) { return ops->skipIdChars(p, end); }
+const char* findNonAscii(const char* p, const char* end) { return ops->findNonAscii(p, end); }
+
+///////////////////////////////////////////////////////////////////////////
+// UTF-8 (RFC 3629)
+
+int utf8SeqLen(const char* p, const char* end) {
+    unsigned char lead = *p;
+    int len;
+    // allowed range of the first continuation byte excludes overlongs,
+    // surrogates (ED A0..BF) and code points past U+10FFFF
+    unsigned char lo = 0x80, hi = 0xBF;
+    if (lead >= 0xC2 and lead <= 0xDF)
+        len = 2;
+    else if (lead >= 0xE0 and lead <= 0xEF)
+        len = 3, lo = lead == 0xE0 ? 0xA0 : 0x80, hi = lead == 0xED ? 0x9F : 0xBF;
+    else if (lead >= 0xF0 and lead <= 0xF4)
+        len = 4, lo = lead == 0xF0 ? 0x90 : 0x80, hi = lead == 0xF4 ? 0x8F : 0xBF;
+    else
+        return 0;
+
+    for (int i = 1; i < len; i++) {
+        if (p + i >= end)
+            return -1;
+        unsigned char c = p[i];
+        if (c < lo or c > hi)
+            return 0;
+        lo = 0x80, hi = 0xBF;
+    }
+    return len;
+}
+
+const char* validateUtf8(const char* p, const char* end) {
+    while ((p = findNonAscii(p, end)) < end) {
+        int len = utf8SeqLen(p, end);
+        if (len <= 0)
+            return p;
+        p += len;
+    }
+    return end;
+}
+
+SimdLevel getSimdLevel() { return ops->level; }
+const char* simdLevelStr(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::AVX2:
+        return "AVX2";
+    case SimdLevel::SSE2:
+        return "SSE2";
+    default:
+        return "SCALAR";
+    }
+}
+bool setSimdLevel(SimdLevel level) {
+    if (not cpuSupports(level))
+        return false;
+    ops = opsFor(level);
+    return true;
+}
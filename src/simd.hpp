@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+
+// Bulk character-run scanning used by the Scanner. All functions search the
+// half-open range [p, end) and return end if nothing is found. The
+// implementation (AVX2, SSE2 or portable scalar) is selected at startup from
+// the running cpu's features.
+
+enum class SimdLevel { SCALAR, SSE2, AVX2 };
+
+// returns ptr to first occurrence of a or b
+const char* findEither(const char* p, const char* end, char a, char b);
+// returns ptr to first char that is not ' ', '\t', '\r' or '\n'
+const char* skipWhitespace(const char* p, const char* end);
+// returns ptr to first char that is not [A-Za-z0-9_]
+const char* skipIdChars(const char* p, const char* end);
+// returns ptr to first byte >= 0x80
+const char* findNonAscii(const char* p, const char* end);
+
+// length (2-4) of the UTF-8 sequence of a non-ASCII char starting at p. Returns
+// 0 if it is not valid UTF-8 (overlong, surrogate, > U+10FFFF, bad byte) and -1
+// if it is a valid prefix cut short by end.
+int utf8SeqLen(const char* p, const char* end);
+// returns ptr to start of the first invalid (or truncated) UTF-8 sequence.
+// ASCII runs are skipped in bulk with findNonAscii.
+const char* validateUtf8(const char* p, const char* end);
+
+SimdLevel getSimdLevel();
+const char* simdLevelStr(SimdLevel level);
+// force a specific implementation; returns false if cpu does not support it
+bool setSimdLevel(SimdLevel level);
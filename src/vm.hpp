@@ -3,6 +3,9 @@
 #include <cassert>
 #include <cstdio>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
 
@@ -51,6 +54,20 @@ struct Value {
         tag = Tag::VAL_STR;
         str = strdup(val);
     }
+    bool operator==(const Value& other) const {
+        if (tag != other.tag)
+            return false;
+        switch (tag) {
+        case Tag::VAL_NUM:
+            return num == other.num;
+        case Tag::VAL_BOOL:
+            return boolean == other.boolean;
+        case Tag::VAL_STR:
+            return strcmp(str, other.str) == 0;
+        default:
+            return true;
+        }
+    }
     bool isNum() const { return tag == Tag::VAL_NUM; }
     bool isBool() const { return tag == Tag::VAL_BOOL; }
     bool isString() const { return tag == Tag::VAL_STR; }
@@ -99,81 +116,366 @@ struct MetaData {
     int lineno = -1;
 };
 
+// number of operands that follow op in the bytecode stream. Each is one
+// byte, or three (little endian) if the instruction is prefixed by OP_WIDE
+inline int numOperands(OpCode op) {
+    switch (op) {
+    case OP_CONST:
+    case OP_DEFINE_LOCAL:
+    case OP_GET_VAR:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+        return 1; // ConstIdx
+    case OP_CALL:
+        return 2; // ConstIdx of fn name, arg count
+    case OP_DEFINE_FN:
+        return 2; // ConstIdx of fn name, index in Chunk::protos
+    case OP_R_PRINT:
+    case OP_R_RET:
+        return 1;
+    case OP_R_MOVE:
+    case OP_R_NOT:
+    case OP_R_NEG:
+    case OP_R_DEFINE_LOCAL:
+    case OP_R_GET_VAR:
+    case OP_R_GET_GLOBAL:
+    case OP_R_SET_GLOBAL:
+    case OP_R_DEFINE_FN:
+        return 2;
+    case OP_R_ADD:
+    case OP_R_SUB:
+    case OP_R_MULT:
+    case OP_R_DIV:
+    case OP_R_OR:
+    case OP_R_AND:
+    case OP_R_CMP:
+    case OP_R_CALL:
+        return 3;
+    default:
+        return 0;
+    }
+}
+constexpr int max_operands = 3;
+static_assert(OP_EOF < 256, "opcodes must fit in a byte");
+
+// Register code (regcodegen.hpp) works on the registers of the running
+// call's frame. An RK operand is register r as r << 1, or constant k as
+// k << 1 | 1, so operations take constants without loading them first.
+enum class Operand : uint8_t { CONST, REG, RK, COUNT, SLOT, GLOBAL };
+inline Operand operandKind(OpCode op, int k) {
+    switch (op) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+        return Operand::SLOT;
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+        return Operand::GLOBAL;
+    case OP_R_GET_GLOBAL:
+        return k ? Operand::GLOBAL : Operand::REG; // dst, slot
+    case OP_R_SET_GLOBAL:
+        return k ? Operand::RK : Operand::GLOBAL; // slot, value
+    case OP_CALL:
+    case OP_DEFINE_FN:
+    case OP_R_DEFINE_FN:
+        return k ? Operand::COUNT : Operand::CONST;
+    case OP_R_PRINT:
+    case OP_R_RET:
+        return Operand::RK;
+    case OP_R_DEFINE_LOCAL:
+        return k ? Operand::RK : Operand::CONST; // name, value
+    case OP_R_GET_VAR:
+        return k ? Operand::CONST : Operand::REG; // dst, name
+    case OP_R_CALL:
+        return k == 0 ? Operand::REG : k == 1 ? Operand::CONST : Operand::COUNT; // dst, name, argc
+    case OP_R_MOVE:
+    case OP_R_NOT:
+    case OP_R_NEG:
+    case OP_R_ADD:
+    case OP_R_SUB:
+    case OP_R_MULT:
+    case OP_R_DIV:
+    case OP_R_OR:
+    case OP_R_AND:
+    case OP_R_CMP:
+        return k ? Operand::RK : Operand::REG; // dst, sources
+    default:
+        return Operand::CONST;
+    }
+}
+inline uint32_t regOperand(uint32_t reg) { return reg << 1; }
+inline uint32_t constOperand(uint32_t idx) { return idx << 1 | 1; }
+constexpr uint32_t max_narrow_operand = 0xff;
+constexpr uint32_t max_wide_operand = 0xffffff;
+
+// Constant pool keys: the same value and type. Numbers compare by bits, so
+// 0 and -0 stay apart and a NaN finds itself.
+struct ConstHash {
+    size_t operator()(const Value& val) const {
+        switch (val.tag) {
+        case Tag::VAL_NUM: {
+            uint64_t bits;
+            memcpy(&bits, &val.num, sizeof(bits));
+            return std::hash<uint64_t>()(bits);
+        }
+        case Tag::VAL_BOOL:
+            return val.boolean + 1;
+        case Tag::VAL_STR:
+            return std::hash<std::string_view>()(val.str);
+        default:
+            return 0;
+        }
+    }
+};
+struct ConstEq {
+    bool operator()(const Value& a, const Value& b) const {
+        if (a.isNum() and b.isNum())
+            return memcmp(&a.num, &b.num, sizeof(a.num)) == 0;
+        return a == b;
+    }
+};
+
+// Slots of the top-level vars of a program, shared by all its chunks like
+// FnTable, and the name lookup for them. A name gets its slot the first time
+// any chunk refers to it, so a fn body can refer to a var defined further
+// down the file; reading it before its definition has run is an error when
+// run. Bodies compiled on worker threads leave new names to be added in
+// order once they are done (see Chunk::defer_globals).
+struct GlobalTable {
+    // slot of name, adding it if no chunk has referred to it yet
+    uint32_t slot(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto [it, added] = index.try_emplace(name, names.size());
+        if (added) {
+            if (names.size() > max_wide_operand)
+                ERR("more than %u top-level vars\n", max_wide_operand + 1);
+            names.push_back(name);
+        }
+        return it->second;
+    }
+    // slot of name, or -1
+    int find(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(name);
+        return it == index.end() ? -1 : int(it->second);
+    }
+    std::string name(uint32_t slot) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return names.at(slot);
+    }
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return names.size();
+    }
+
+  private:
+    std::mutex mutex;
+    std::vector<std::string> names; // by slot
+    std::unordered_map<std::string, uint32_t> index;
+};
+
+struct FnProto;
+struct FnTable;
+
 typedef int ConstIdx;
 struct Chunk {
     Chunk() {}
-    Chunk(const Chunk& initcode)
-        : constants(initcode.constants), code(initcode.code), metadata(initcode.metadata) {}
-    void addOp(OpCode op, int lineno = -1) {
-        code.push_back(op);
-        metadata.push_back({lineno});
+    void addOp(OpCode op, int lineno = -1) { addByte(op, lineno); }
+    // op and its operands, wide if any of them needs it
+    void addOp(OpCode op, std::initializer_list<uint32_t> operands, int lineno = -1) {
+        assert(int(operands.size()) == numOperands(op));
+        bool wide = false;
+        for (auto operand : operands) {
+            assert(operand <= max_wide_operand);
+            wide |= operand > max_narrow_operand;
+        }
+        if (wide)
+            addByte(OP_WIDE, lineno);
+        addByte(op, lineno);
+        for (auto operand : operands) {
+            addByte(operand & 0xff, lineno);
+            if (wide) {
+                addByte((operand >> 8) & 0xff, lineno);
+                addByte(operand >> 16, lineno);
+            }
+        }
     }
     ConstIdx addConstStr(const std::string& val, int lineno = -1) {
         auto idx = regConstVal<std::string>(val);
-        addOp(OP_CONST);
-        // constant is Constidx stored directly in bytecode stream
-        addOp(OpCode(idx));
+        addOp(OP_CONST, {uint32_t(idx)}, lineno);
         return idx;
     }
     ConstIdx addConstNum(double val, int lineno = -1) {
         auto idx = regConstVal<double>(val);
-        addOp(OP_CONST);
-        // constant is Constidx stored directly in bytecode stream
-        addOp(OpCode(idx));
+        addOp(OP_CONST, {uint32_t(idx)}, lineno);
         return idx;
     }
     ConstIdx addConstBool(bool val, int lineno = -1) {
         auto idx = regConstVal<bool>(val);
-        addOp(OP_CONST);
-        // constant is Constidx stored directly in bytecode stream
-        addOp(OpCode(idx));
+        addOp(OP_CONST, {uint32_t(idx)}, lineno);
         return idx;
     }
     ConstIdx addConstNull(int lineno = -1) {
-        auto idx = constants.size();
-        assert(constants.size() < 255);
-        constants.push_back(Value());
-        addOp(OP_CONST);
-        addOp(OpCode(idx));
+        auto idx = regConst(Value());
+        addOp(OP_CONST, {uint32_t(idx)}, lineno);
         return idx;
     }
+    // op whose operand is the name constant for name
+    void addNameOp(OpCode op, const std::string& name, int lineno = -1) {
+        addOp(op, {uint32_t(regConstVal<std::string>(name))}, lineno);
+    }
+    // read var name: from its slot once it is a defined local, else from
+    // its global slot; by name if the chunk has no GlobalTable
+    void addGetVar(const std::string& name, int lineno = -1) {
+        int slot = localSlot(name);
+        if (slot >= 0)
+            addOp(OP_GET_LOCAL, {uint32_t(slot)}, lineno);
+        else if (globals)
+            addGlobalOp(OP_GET_GLOBAL, name, lineno);
+        else
+            addNameOp(OP_GET_VAR, name, lineno);
+    }
+    // define var name to the value at tos
+    void addDefineVar(const std::string& name, int lineno = -1) {
+        if (slots)
+            addOp(OP_SET_LOCAL, {defineLocal(name)}, lineno);
+        else if (globals)
+            addGlobalOp(OP_SET_GLOBAL, name, lineno);
+        else
+            addNameOp(OP_DEFINE_LOCAL, name, lineno);
+    }
+
+    // op whose operand is the global slot of name. A name the GlobalTable
+    // does not have yet gets a wide placeholder if globals are deferred.
+    void addGlobalOp(OpCode op, const std::string& name, int lineno = -1) {
+        int slot = defer_globals ? globals->find(name) : int(globals->slot(name));
+        if (slot >= 0) {
+            addOp(op, {uint32_t(slot)}, lineno);
+            return;
+        }
+        addByte(OP_WIDE, lineno);
+        addByte(op, lineno);
+        unbound_globals.emplace_back(code.size(), name);
+        for (int i = 0; i < 3; i++)
+            addByte(0, lineno);
+    }
+    // give the placeholders their slots, adding the names in the order they
+    // were reached
+    void bindGlobals() {
+        for (auto& [pos, name] : unbound_globals) {
+            uint32_t slot = globals->slot(name);
+            code[pos] = slot & 0xff;
+            code[pos + 1] = (slot >> 8) & 0xff;
+            code[pos + 2] = slot >> 16;
+        }
+        unbound_globals.clear();
+        defer_globals = false;
+    }
+
+    // The locals of a fn body live in slots of its call's frame, params
+    // first, and are resolved to them as the body is compiled; defineFn()
+    // sets this up. A var is only resolved to its slot from its definition
+    // on, reads before that still go by name. Top-level vars have no slots.
+    //
+    // slot of local name, or -1 if it is not defined (yet)
+    int localSlot(const std::string& name) const {
+        if (not slots)
+            return -1;
+        auto it = local_index.find(name);
+        return it == local_index.end() ? -1 : int(it->second);
+    }
+    // a new slot for name, not visible until bindLocal()
+    uint32_t newLocal(const std::string& name) {
+        assert(slots);
+        if (locals.size() > max_wide_operand)
+            ERR("more than %u locals in one fn\n", max_wide_operand + 1);
+        locals.push_back(name);
+        return locals.size() - 1;
+    }
+    void bindLocal(const std::string& name, uint32_t slot) { local_index[name] = slot; }
+    // slot of local name, defining it if it is not yet
+    uint32_t defineLocal(const std::string& name) {
+        int slot = localSlot(name);
+        if (slot >= 0)
+            return slot;
+        uint32_t added = newLocal(name);
+        bindLocal(name, added);
+        return added;
+    }
+    // emit OP_DEFINE_FN for a new function, whose body is still to be filled in
+    FnProto& defineFn(const std::string& name,
+                      std::vector<std::string> params,
+                      OpCode op = OP_DEFINE_FN);
+    // index of constant in the pool, which is added if it isn't there yet
     template <typename T> ConstIdx regConstVal(T constant) {
-        assert(constants.size() < 255);
-        constants.push_back(Value(constant));
-        std::cout << "defining constant " << constant << " at idx " << constants.size() - 1 << "\n";
-        return constants.size() - 1;
+        size_t nconsts = constants.size();
+        ConstIdx idx = regConst(Value(constant));
+        if (codegenVerbose and constants.size() > nconsts)
+            std::cout << "defining constant " << constant << " at idx " << idx << "\n";
+        return idx;
     }
+    ConstIdx regConst(const Value& val) {
+        auto [it, added] = const_index.try_emplace(val, constants.size());
+        if (added) {
+            if (constants.size() > max_wide_operand)
+                ERR("more than %u constants in one chunk\n", max_wide_operand + 1);
+            constants.push_back(val);
+        }
+        return it->second;
+    }
+    const Value& constant(ConstIdx idx) const { return constants.at(idx); }
     Value getConst(ConstIdx idx) { 
         DEBUG("\tvm: read const[%d]\n",idx);
         assert(idx < int(constants.size()));
         return constants.at(idx); 
     }
 
+    // drop the code and constants, keeping fns, protos and locals
+    void clearCode() {
+        code.clear();
+        metadata.clear();
+        constants.clear();
+        const_index.clear();
+    }
+
     void finalize() {
         // chunk always ends in EOF token
-        assert(code.size());
-        if (code.back() != OP_EOF) {
+        if (code.empty() or code.back() != OP_EOF) {
             addOp(OP_RET);
             addOp(OP_EOF);
         }
         assert(metadata.size() == code.size());
     }
+    // same bytecode, constants and functions
+    bool operator==(const Chunk& other) const;
     auto begin() { return code.begin(); }
     auto end() { return code.end(); }
+    size_t size() const { return code.size(); }
+    size_t numConsts() const { return constants.size(); }
 
-    void print_raw_listing(){
-        int i=0;
-        for (auto it = code.begin(); it != code.end(); it++, i++) {
-            OpCode op = *it;
-            printf(CYAN "  %2d: %#04X (%s)\n", i, op, opcode_to_str[op]);
-            if ((op == OP_CONST or op == OP_DEFINE_GLOBAL or op == OP_DEFINE_LOCAL) && std::next(it) != code.end()) {
-                printf(CYAN "  %2d: %#04X \n", ++i, *(++it));
+    // Decode the instruction at code[pos] into op and operands, skipping an
+    // OP_WIDE prefix. Returns the position of the next instruction.
+    size_t decode(size_t pos, OpCode& op, uint32_t operands[max_operands]) const {
+        bool wide = code[pos] == OP_WIDE;
+        pos += wide;
+        op = OpCode(code[pos++]);
+        for (int k = 0; k < numOperands(op) and pos < code.size(); k++) {
+            operands[k] = code[pos++];
+            if (wide) {
+                operands[k] |= code[pos] << 8 | code[pos + 1] << 16;
+                pos += 2;
             }
         }
+        return pos;
+    }
+
+    void print_raw_listing(){
+        for (size_t i = 0; i < code.size(); i++)
+            printf(CYAN "  %2zu: %#04X\n", i, code[i]);
     }
 
     void list() {
-        int i = 0;
         printf(CYAN "== CONSTANTS TABLE ==\n");
         for (size_t i=0; i < constants.size(); i++) {
             printf(CYAN " %2ld: %s \n",i,constants[i].tostr().c_str());
@@ -182,66 +484,225 @@ struct Chunk {
         print_raw_listing();
         printf(CYAN "== BYTECODE LISTING ==\n");
         printf(CYAN "------------\n" RESET);
-        i=0;
-        for (auto it = code.begin(); it != code.end(); it++, i++) {
-            OpCode op = *it;
-            printf(CYAN "  %d" RESET ": %s \n", i, opcode_to_str[op]);
-            if (op == OP_CONST or op == OP_DEFINE_GLOBAL or op == OP_DEFINE_LOCAL) {
-                op = *(++it);
-                i++;
-                printf(CYAN "  %d" RESET ": \tCONST=%s\n", i, getConst(op).tostr().c_str());
+        for (size_t i = 0, next; i < code.size(); i = next) {
+            OpCode op;
+            uint32_t operands[max_operands];
+            next = decode(i, op, operands);
+            printf(CYAN "  %zu" RESET ": %s%s \n", i, code[i] == OP_WIDE ? "(WIDE) " : "", opcode_to_str[op]);
+            for (int k = 0; k < numOperands(op); k++) {
+                uint32_t operand = operands[k];
+                std::string text;
+                switch (operandKind(op, k)) {
+                case Operand::CONST:
+                    text = "CONST=" + getConst(operand).tostr();
+                    break;
+                case Operand::COUNT:
+                    text = (op == OP_CALL or op == OP_R_CALL ? "ARGC=" : "FN=") + std::to_string(operand);
+                    break;
+                case Operand::RK:
+                    if (operand & 1)
+                        text = "K=" + getConst(operand >> 1).tostr();
+                    else
+                        text = "R" + std::to_string(operand >> 1);
+                    break;
+                case Operand::REG:
+                    text = "R" + std::to_string(operand);
+                    break;
+                case Operand::SLOT:
+                    text = "SLOT=" + std::to_string(operand) + " (" + locals.at(operand) + ")";
+                    break;
+                case Operand::GLOBAL:
+                    text = "GLOBAL=" + std::to_string(operand) + " (" + globals->name(operand) + ")";
+                    break;
+                }
+                printf(CYAN "  %zu" RESET ": \t%s\n", i, text.c_str());
             }
         }
         printf(CYAN "== ---------------- ==\n");
     }
 
+    // functions callable from this chunk, shared by all chunks of a program
+    FnTable* fns = nullptr;
+    // slots of top-level vars, shared the same way
+    GlobalTable* globals = nullptr;
+    // Set while the chunk is compiled alongside others: a name the
+    // GlobalTable lacks is not added, as its slot would depend on which
+    // thread got there first, but left for bindGlobals()
+    bool defer_globals = false;
+    // register code, run by VM::execRegs(), using nregs registers per call
+    bool registers = false;
+    uint32_t nregs = 0;
+    // a fn body, whose locals are in slots (see localSlot())
+    bool slots = false;
+    std::vector<std::string> locals; // name of each slot
+    // functions defined by this chunk, indexed by OP_DEFINE_FN. Shared with
+    // copies of the chunk and with fns once bound, so they outlive it
+    std::vector<std::shared_ptr<FnProto>> protos;
+
     ////////////////////////////////////////////////////////////////////
   private:
+    void addByte(uint8_t byte, int lineno) {
+        code.push_back(byte);
+        metadata.push_back({lineno});
+    }
+
     std::vector<Value> constants;
-    std::vector<OpCode> code;
+    std::unordered_map<Value, ConstIdx, ConstHash, ConstEq> const_index;
+    std::unordered_map<std::string, uint32_t> local_index; // slots of defined locals
+    std::vector<std::pair<size_t, std::string>> unbound_globals; // operand position, name
+    std::vector<uint8_t> code;
     std::vector<MetaData> metadata;
 };
 
-// note stack can be modified in place!
-#define UNARY_OP(__op__)                                                                           \
-    {                                                                                              \
-        Value operand = tos();                                                                     \
-        if (operand.isNum()) {                                                                     \
-            tos().num = __op__ operand.asNum();                                                    \
-        } else if (operand.isBool()) {                                                             \
-            tos().boolean = __op__ operand.asBool();                                               \
-        }                                                                                          \
+// A function's parameters and bytecode. Bodies recorded as a source range
+// are only parsed and compiled by FnTable::compile on their first call.
+struct FnProto {
+    std::vector<std::string> params;
+    std::string_view source;     // buffer holding the body, for line numbers
+    uint32_t begin = 0, end = 0; // body is source[begin:end], '{' to '}'
+    Chunk code;
+    bool compiled = false;
+};
+
+// Functions by name, bound as their OP_DEFINE_FN runs. The front end that
+// emits the code sets compile to build the code of a lazily recorded body.
+struct FnTable {
+    // a redefinition replaces the binding; the old FnProto stays alive while
+    // it is running or its chunk is
+    void bind(const std::string& name, std::shared_ptr<FnProto> fn) { by_name[name] = fn; }
+    FnProto* get(const std::string& name) {
+        auto it = by_name.find(name);
+        return it == by_name.end() ? nullptr : it->second.get();
+    }
+
+    void (*compile)(FnProto& fn) = nullptr;
+    std::unordered_map<std::string, std::shared_ptr<FnProto>> by_name;
+};
+
+inline FnProto& Chunk::defineFn(const std::string& name, std::vector<std::string> params, OpCode op) {
+    ConstIdx name_idx = regConstVal<std::string>(name);
+    addOp(op, {uint32_t(name_idx), uint32_t(protos.size())});
+    auto& fn = *protos.emplace_back(std::make_shared<FnProto>());
+    fn.params = std::move(params);
+    fn.code.fns = fns;
+    fn.code.globals = globals;
+    fn.code.slots = true;
+    // one slot per arg, even if a name repeats; the last one is the param
+    for (auto& param : fn.params)
+        fn.code.bindLocal(param, fn.code.newLocal(param));
+    return fn;
+}
+
+inline bool Chunk::operator==(const Chunk& other) const {
+    if (code != other.code or constants != other.constants or protos.size() != other.protos.size() or
+        registers != other.registers or nregs != other.nregs or slots != other.slots or
+        locals != other.locals)
+        return false;
+    for (size_t i = 0; i < protos.size(); i++) {
+        const FnProto& a = *protos[i];
+        const FnProto& b = *other.protos[i];
+        if (a.params != b.params or a.begin != b.begin or a.end != b.end or
+            a.compiled != b.compiled or not(a.code == b.code))
+            return false;
+    }
+    return true;
+}
+
+// The VM's arithmetic, also used to fold constants (fold.hpp).
+// Unary ops keep the operand's type; other types pass through unchanged.
+template <typename Op>
+inline Value unaryOp(Value operand, Op op) {
+    if (operand.isNum()) {
+        operand.num = op(operand.asNum());
+    } else if (operand.isBool()) {
+        operand.boolean = op(operand.asBool());
+    }
+    return operand;
+}
+// two nums give num op num, anything else is done on their truth values
+template <typename Op>
+inline Value binaryOp(const Value& A, const Value& B, Op op) {
+    if (A.isNum() and B.isNum())
+        return op(A.asNum(), B.asNum());
+    return op(A.asBool(), B.asBool());
+}
+
+// op applied to constants, as the VM would do it
+inline Value evalUnaryOp(OpCode op, const Value& operand) {
+    if (op == OP_NOT)
+        return unaryOp(operand, [](auto x) { return !x; });
+    assert(op == OP_NEG);
+    return unaryOp(operand, [](auto x) { return -x; });
+}
+// false where the VM has no defined result: bools divide as ints
+inline bool evalBinaryOp(OpCode op, const Value& A, const Value& B, Value& result) {
+    switch (op) {
+    case OP_ADD: result = binaryOp(A, B, [](auto a, auto b) { return a + b; }); return true;
+    case OP_SUB: result = binaryOp(A, B, [](auto a, auto b) { return a - b; }); return true;
+    case OP_MULT: result = binaryOp(A, B, [](auto a, auto b) { return a * b; }); return true;
+    case OP_DIV:
+        if (not(A.isNum() and B.isNum()) and not B.asBool())
+            return false;
+        result = binaryOp(A, B, [](auto a, auto b) { return a / b; });
+        return true;
+    case OP_AND: result = binaryOp(A, B, [](auto a, auto b) { return a && b; }); return true;
+    case OP_OR: result = binaryOp(A, B, [](auto a, auto b) { return a || b; }); return true;
+    case OP_CMP: result = binaryOp(A, B, [](auto a, auto b) { return a == b; }); return true;
+    default: return false;
     }
+}
+
+// note stack can be modified in place!
+#define UNARY_OP(__op__) tos() = unaryOp(tos(), [](auto x) { return __op__ x; })
+
+// dst register A from RK operands B and C
+#define REG_BINARY_OP(__op__) reg(A) = binaryOp(rk(B), rk(C), [](auto a, auto b) { return a __op__ b; })
 
 // NOTE: must pop b before a, as a will be pushed unto the stack first!
 #define BINARY_OP(__op__)                                                                          \
     {                                                                                              \
         Value B = pop();                                                                           \
         Value A = pop();                                                                           \
-        if (A.isNum() and B.isNum()) {                                                             \
-            push(A.asNum() __op__ B.asNum());                                                      \
-        } else {                                                                                   \
-            push(A.asBool() __op__ B.asBool());                                                    \
-        }                                                                                          \
+        push(binaryOp(A, B, [](auto a, auto b) { return a __op__ b; }));                          \
     }
 typedef std::unordered_map<std::string,Value> VarFrame;
 enum class VMStatus { OK, ERR, INF_LOOP };
 struct VM {
     // returns pair of {op code , offset in bytecode chunk }
-    std::pair<OpCode, int> readOp() { return {*ip++, ip - code.begin()}; }
-    VM(const Chunk& initcode) : code(initcode) {
-        code.finalize();
-        code.list();
+    std::pair<OpCode, int> readOp() { return {OpCode(*ip++), ip - chunk->begin()}; }
+    // next operand of the current instruction
+    uint32_t readOperand() {
+        if (not wide)
+            return *ip++;
+        uint32_t operand = ip[0] | ip[1] << 8 | ip[2] << 16;
+        ip += 3;
+        return operand;
+    }
+    VM() {
         push(Value()); // push null val into first position on the stack
         new_varframe();
     }
+    VM(const Chunk& initcode) : VM() { load(initcode); }
+    // replace the code to run; variables and fns defined so far are kept
+    void load(const Chunk& newcode) {
+        code = newcode;
+        code.finalize();
+        if (trace)
+            code.list();
+    }
+    // constant idx of the running chunk
+    const Value& readConst(ConstIdx idx) {
+        if (trace)
+            printf("\tvm: read const[%d]\n", idx);
+        return chunk->constant(idx);
+    }
     void printStatus(const char* arg) { printf(CYAN BOLD "Exit status = %s\n\n" RESET, arg); };
     VMStatus run() {
         printf(GREEN BOLD "\nVM Starting!\n"
                           "------------\n" RESET);
 
         auto starttime = getTime();
-        auto stat = exec();
+        auto stat = code.registers ? execRegs() : exec();
         printf(CYAN BOLD "\n-----------------------\n"
                          "VM completed in %.2g μs\n" RESET,
                timeSinceMicro(starttime));
@@ -265,17 +726,28 @@ struct VM {
         }
         return stat;
     }
+    VMStatus run(const Chunk& newcode) {
+        load(newcode);
+        return run();
+    }
     VMStatus exec() {
+        // drop whatever a failed run left behind
+        frames.clear();
+        stack.resize(1);
+        fp = 0;
+        localvar_stack.resize(1);
+
+        chunk = &code;
         ip = code.begin();
-        constexpr int max_icount = 50;
-        auto end = code.end();
-        for (int icount = 0; icount < max_icount && ip != end; icount++) {
+        wide = false;
+        for (icount = 0; icount < vm_max_icount && ip != chunk->end(); icount++) {
             auto op_pair = readOp();
             OpCode op = op_pair.first;
             int pos = op_pair.second;
 
             auto printOp = [this, op, pos]() {
-                DEBUG("%3d: %-8s %s\n", pos, opcode_to_str[op], tos().tostr().c_str());
+                if (trace)
+                    printf("%3d: %-8s %s\n", pos, opcode_to_str[op], tos().tostr().c_str());
             };
 
             switch (op) {
@@ -283,8 +755,13 @@ struct VM {
                 printOp();
                 break;
             }
+            case OP_WIDE: {
+                // applies to the operands of the next instruction only
+                wide = true;
+                continue;
+            }
             case OP_CONST: {
-                push(code.getConst(readOp().first));
+                push(readConst(readOperand()));
                 printOp();
                 break;
             }
@@ -334,7 +811,8 @@ struct VM {
                 break;
             }
             case OP_PRINT: {
-                printf(BOLD "vmprint: %s\n" RESET, pop().tostr().c_str());
+                // leave the value, print is an expression too
+                printf(BOLD "vmprint: %s\n" RESET, tos().tostr().c_str());
                 printOp();
                 break;
             }
@@ -344,53 +822,138 @@ struct VM {
             }
             case OP_RET: {
                 printOp();
-                return VMStatus::OK;
+                if (frames.empty())
+                    return VMStatus::OK;
+
+                // drop the callee's stack and locals, leaving its result
+                Value result = pop();
+                stack.resize(frames.back().stack_base);
+                chunk = frames.back().chunk;
+                ip = frames.back().ip;
+                frames.pop_back();
+                fp = frames.empty() ? 0 : frames.back().stack_base;
+                push(result);
+                break;
             }
             case OP_POP: {
                 pop();
                 printOp();
-                return VMStatus::OK;
+                break;
             }
-            case OP_DEFINE_GLOBAL: {
+            case OP_GET_VAR: {
                 // next OpCode is ConstIdx of varname
-                ConstIdx const_idx = readOp().first;
-                Value val = code.getConst(const_idx);
-                assert(val.isString());
-                auto varname = val.asString(); 
-                
-                // store the value at tos in global map
-                globals[varname] = pop();
+                auto varname = readConst(readOperand()).asString();
+                Value* val = lookup(varname);
+                if (not val) {
+                    printf(RED "%d: undefined variable '%s'\n" RESET, pos, varname.c_str());
+                    return VMStatus::ERR;
+                }
+                push(*val);
+                printOp();
+                break;
+            }
+            case OP_GET_LOCAL: {
+                // next OpCode is the slot
+                push(stack[fp + readOperand()]);
+                printOp();
+                break;
+            }
+            case OP_SET_LOCAL: {
+                // store the value at tos in the slot, leaving it as the result
+                uint32_t slot = readOperand();
+                stack[fp + slot] = tos();
+                printOp();
+                if (trace)
+                    printf("\tvm: defined _local_ " MAGENTA "%s" RESET " = %s (slot %u)\n",
+                           chunk->locals[slot].c_str(),
+                           tos().tostr().c_str(),
+                           slot);
+                break;
+            }
+            case OP_DEFINE_FN: {
+                // next OpCodes are ConstIdx of fn name and index of its FnProto
+                auto fn_name = readConst(readOperand()).asString();
+                int fn_idx = readOperand();
+                if (not chunk->fns) {
+                    printf(RED "%d: no function table to define '%s' in\n" RESET, pos, fn_name.c_str());
+                    return VMStatus::ERR;
+                }
+                chunk->fns->bind(fn_name, chunk->protos.at(fn_idx));
+                push(Value());
                 printOp();
-                printf("\tvm: defined global " MAGENTA "%s" RESET " = %s (const %d)\n",
-                        varname.c_str(),
-                        globals[varname].tostr().c_str(),
-                        const_idx);
-                return VMStatus::OK;
+                break;
+            }
+            case OP_CALL: {
+                // next OpCodes are ConstIdx of fn name and arg count
+                auto fn_name = readConst(readOperand()).asString();
+                int argc = readOperand();
+                FnProto* fn = chunk->fns ? chunk->fns->get(fn_name) : nullptr;
+                if (not fn) {
+                    printf(RED "%d: undefined function '%s'\n" RESET, pos, fn_name.c_str());
+                    return VMStatus::ERR;
+                } else if (int(fn->params.size()) != argc) {
+                    printf(RED "%d: '%s' takes %zu args, got %d\n" RESET,
+                           pos,
+                           fn_name.c_str(),
+                           fn->params.size(),
+                           argc);
+                    return VMStatus::ERR;
+                }
+                compileOnFirstCall(*fn, fn_name);
+
+                // the args become the callee's first slots, its other locals start out null
+                fp = stack.size() - argc;
+                frames.push_back({chunk, ip, fp});
+                chunk = &fn->code;
+                ip = chunk->begin();
+                stack.resize(fp + chunk->locals.size());
+                printOp();
+                break;
+            }
+            case OP_GET_GLOBAL: {
+                // next OpCode is the global slot
+                uint32_t slot = readOperand();
+                if (not definedGlobal(slot)) {
+                    printf(RED "%d: undefined variable '%s'\n" RESET, pos, code.globals->name(slot).c_str());
+                    return VMStatus::ERR;
+                }
+                push(globals[slot].val);
+                printOp();
+                break;
+            }
+            case OP_SET_GLOBAL: {
+                // store the value at tos in the slot, leaving it as the result
+                uint32_t slot = readOperand();
+                printOp();
+                setGlobal(slot, tos());
+                break;
             }
             case OP_DEFINE_LOCAL: {
                 // next OpCode is ConstIdx of varname
-                ConstIdx const_idx = readOp().first;
-                Value val = code.getConst(const_idx);
+                ConstIdx const_idx = readOperand();
+                Value val = readConst(const_idx);
                 assert(val.isString());
                 auto varname = val.asString(); 
                 
-                // store the value at tos in global map
-                get_varframe()[varname] = pop();
+                // store the value at tos in the current frame, leaving it as the result
+                get_varframe()[varname] = tos();
                 printOp();
-                printf("\tvm: defined _local_ " MAGENTA "%s" RESET " = %s (const %d)\n",
-                        varname.c_str(),
-                        get_varframe()[varname].tostr().c_str(),
-                        const_idx);
-                return VMStatus::OK;
+                if (trace)
+                    printf("\tvm: defined _local_ " MAGENTA "%s" RESET " = %s (const %d)\n",
+                           varname.c_str(),
+                           get_varframe()[varname].tostr().c_str(),
+                           const_idx);
+                break;
             }
             default: {
                 printf(RED "%d: unimplemented op code %s (%d) \n" RESET, pos, opcode_to_str[op], op);
                 exit(0);
             }
             }
+            wide = false;
 
             // print stack after opcode processed
-            if (debug && debug_vmstack) {
+            if (trace && debug_vmstack) {
                 printf("\t\tSTACK \n\t\t{\n");
                 for (int i = stack.size() - 1; i > 0; --i) {
                     Value val = stack[i];
@@ -402,6 +965,194 @@ struct VM {
         return VMStatus::INF_LOOP;
     }
 
+    // Run register code (Chunk::registers). Each call gets a window of
+    // chunk->nregs registers from base, its locals first. R_CALL passes args
+    // in the caller's registers, which become the callee's first ones, and
+    // gets the result back in the first of them.
+    VMStatus execRegs() {
+        frames.clear();
+        localvar_stack.resize(1);
+
+        chunk = &code;
+        ip = code.begin();
+        wide = false;
+        base = 0;
+        if (regs.size() < code.nregs)
+            regs.resize(code.nregs);
+        for (icount = 0; icount < vm_max_icount && ip != chunk->end(); icount++) {
+            auto [op, pos] = readOp();
+            if (op == OP_WIDE) {
+                wide = true;
+                continue;
+            }
+            uint32_t operands[max_operands];
+            for (int k = 0; k < numOperands(op); k++)
+                operands[k] = readOperand();
+            wide = false;
+            uint32_t A = operands[0], B = operands[1], C = operands[2];
+            if (trace)
+                printf("%3d: %s\n", pos, opcode_to_str[op]);
+
+            switch (op) {
+            case OP_NOP: break;
+            case OP_R_MOVE: reg(A) = rk(B); break;
+            case OP_R_NOT: reg(A) = unaryOp(rk(B), [](auto x) { return !x; }); break;
+            case OP_R_NEG: reg(A) = unaryOp(rk(B), [](auto x) { return -x; }); break;
+            case OP_R_ADD: REG_BINARY_OP(+); break;
+            case OP_R_SUB: REG_BINARY_OP(-); break;
+            case OP_R_MULT: REG_BINARY_OP(*); break;
+            case OP_R_DIV: REG_BINARY_OP(/); break;
+            case OP_R_AND: REG_BINARY_OP(&&); break;
+            case OP_R_OR: REG_BINARY_OP(||); break;
+            case OP_R_CMP: REG_BINARY_OP(==); break;
+            case OP_R_PRINT: printf(BOLD "vmprint: %s\n" RESET, rk(A).tostr().c_str()); break;
+            case OP_R_GET_VAR: {
+                auto varname = readConst(B).asString();
+                Value* val = lookup(varname);
+                if (not val) {
+                    printf(RED "%d: undefined variable '%s'\n" RESET, pos, varname.c_str());
+                    return VMStatus::ERR;
+                }
+                reg(A) = *val;
+                break;
+            }
+            case OP_R_GET_GLOBAL: {
+                if (not definedGlobal(B)) {
+                    printf(RED "%d: undefined variable '%s'\n" RESET, pos, code.globals->name(B).c_str());
+                    return VMStatus::ERR;
+                }
+                reg(A) = globals[B].val;
+                break;
+            }
+            case OP_R_SET_GLOBAL: setGlobal(A, rk(B)); break;
+            case OP_R_DEFINE_LOCAL: {
+                auto varname = readConst(A).asString();
+                Value& var = get_varframe()[varname] = rk(B);
+                if (trace)
+                    printf("\tvm: defined _local_ " MAGENTA "%s" RESET " = %s (const %d)\n",
+                           varname.c_str(),
+                           var.tostr().c_str(),
+                           A);
+                break;
+            }
+            case OP_R_DEFINE_FN: {
+                auto fn_name = readConst(A).asString();
+                if (not chunk->fns) {
+                    printf(RED "%d: no function table to define '%s' in\n" RESET, pos, fn_name.c_str());
+                    return VMStatus::ERR;
+                }
+                chunk->fns->bind(fn_name, chunk->protos.at(B));
+                break;
+            }
+            case OP_R_CALL: {
+                auto fn_name = readConst(B).asString();
+                FnProto* fn = chunk->fns ? chunk->fns->get(fn_name) : nullptr;
+                if (not fn) {
+                    printf(RED "%d: undefined function '%s'\n" RESET, pos, fn_name.c_str());
+                    return VMStatus::ERR;
+                } else if (fn->params.size() != C) {
+                    printf(RED "%d: '%s' takes %zu args, got %u\n" RESET,
+                           pos,
+                           fn_name.c_str(),
+                           fn->params.size(),
+                           C);
+                    return VMStatus::ERR;
+                }
+                compileOnFirstCall(*fn, fn_name);
+
+                // the callee's registers start at the args, its params
+                frames.push_back({chunk, ip, base, A});
+                base += A;
+                chunk = &fn->code;
+                ip = chunk->begin();
+                if (regs.size() < base + chunk->nregs)
+                    regs.resize(base + chunk->nregs);
+                break;
+            }
+            case OP_R_RET: {
+                if (frames.empty())
+                    return VMStatus::OK;
+                Value result = rk(A);
+                chunk = frames.back().chunk;
+                ip = frames.back().ip;
+                base = frames.back().stack_base;
+                reg(frames.back().dst) = result;
+                frames.pop_back();
+                break;
+            }
+            case OP_RET: {
+                // Chunk::finalize() ends the top level with RET
+                if (frames.empty())
+                    return VMStatus::OK;
+                printf(RED "%d: stack op code %s in register code\n" RESET, pos, opcode_to_str[op]);
+                return VMStatus::ERR;
+            }
+            case OP_EOF: return VMStatus::ERR;
+            default: {
+                printf(RED "%d: unimplemented op code %s (%d) \n" RESET, pos, opcode_to_str[op], op);
+                exit(0);
+            }
+            }
+
+            if (trace && debug_vmstack) {
+                printf("\t\tREGS \n\t\t{\n");
+                for (size_t i = 0; i < chunk->nregs; i++)
+                    printf("\t\t\t[R%zu] %s\n", i, regs[base + i].tostr().c_str());
+                printf("\t\t}\n");
+            }
+        }
+        return VMStatus::INF_LOOP;
+    }
+
+    // top-level vars, in slots of the GlobalTable shared by all the chunks
+    // of the code loaded
+    bool definedGlobal(uint32_t slot) const { return slot < globals.size() and globals[slot].defined; }
+    void setGlobal(uint32_t slot, const Value& val) {
+        // slots are added as code referring to them is compiled
+        if (slot >= globals.size())
+            globals.resize(code.globals->size());
+        globals[slot] = {val, true};
+        if (trace)
+            printf("\tvm: defined global " MAGENTA "%s" RESET " = %s (slot %u)\n",
+                   code.globals->name(slot).c_str(),
+                   val.tostr().c_str(),
+                   slot);
+    }
+
+    // embedding API: top-level var name, or null if it is not defined. Looks
+    // name up in the GlobalTable of the code loaded, if it has one.
+    Value* global(const std::string& name) {
+        if (not code.globals)
+            return lookup(name);
+        int slot = code.globals->find(name);
+        return slot >= 0 and definedGlobal(slot) ? &globals[slot].val : nullptr;
+    }
+    void defineGlobal(const std::string& name, const Value& val) {
+        if (not code.globals) {
+            localvar_stack.front()[name] = val;
+            return;
+        }
+        setGlobal(code.globals->slot(name), val);
+    }
+
+    // compile a lazy fn body before running it
+    void compileOnFirstCall(FnProto& fn, const std::string& fn_name) {
+        if (fn.compiled)
+            return;
+        auto starttime = getTime();
+        chunk->fns->compile(fn);
+        if (trace)
+            printf("\tvm: compiled " MAGENTA "%s" RESET " on first call in %.3g ms\n",
+                   fn_name.c_str(),
+                   timeSinceMilli(starttime));
+    }
+
+    // registers of the running call, and RK operands (see operandKind)
+    Value& reg(uint32_t r) { return regs[base + r]; }
+    const Value& rk(uint32_t operand) {
+        return operand & 1 ? readConst(operand >> 1) : regs[base + (operand >> 1)];
+    }
+
     // stack manipulation
     bool empty() { return stack.size() <= 1; }
     void push(Value val) { stack.push_back(val); }
@@ -416,18 +1167,39 @@ struct VM {
     // for manipulating local var stack frames
     VarFrame& get_varframe() { return localvar_stack.back(); }
     VarFrame& new_varframe() { localvar_stack.push_back({}); return get_varframe(); }
-    VarFrame& pop_varframe() {
-        assert(localvar_stack.size());
-        VarFrame& tos = localvar_stack.back();
-        localvar_stack.pop_back();
-        return tos;
+    // top-level vars by name, for code without a GlobalTable
+    Value* lookup(const std::string& varname) {
+        auto& vars = localvar_stack.front();
+        auto it = vars.find(varname);
+        return it == vars.end() ? nullptr : &it->second;
     }
 
     ////////////////////////////////////////////////////////////////////
+    // where to resume the caller once a call returns
+    struct CallFrame {
+        Chunk* chunk;
+        std::vector<uint8_t>::const_iterator ip;
+        size_t stack_base; // callee's first slot, where its args were; or register base
+        uint32_t dst = 0;  // register for the result, in register code
+    };
+
     Chunk code;
-    std::vector<OpCode>::const_iterator ip;
+    Chunk* chunk = nullptr; // chunk being executed, code or a function's
+    std::vector<uint8_t>::const_iterator ip;
+    bool wide = false; // operands of the current instruction are 3 bytes
+    long icount = 0;   // instructions executed by the last run
+    // print each instruction, the code loaded and vars defined
+    bool trace = debug;
+    std::vector<CallFrame> frames;
     std::vector<Value> stack;
-    std::unordered_map<std::string,Value> globals;
+    size_t fp = 0; // first slot of the running call, in stack
+    std::vector<Value> regs;
+    size_t base = 0; // first register of the running call
+    struct Global {
+        Value val;
+        bool defined = false;
+    };
+    std::vector<Global> globals; // by GlobalTable slot
     std::vector<VarFrame> localvar_stack;
 };
 